@@ -1,7 +1,7 @@
 TARGET  = qheif
 
-HEADERS += qheifhandler_p.h
-SOURCES += main.cpp qheifhandler.cpp
+HEADERS += qheifconvert_p.h qheifhandler_p.h
+SOURCES += main.cpp qheifconvert.cpp qheifhandler.cpp
 OTHER_FILES += heif.json
 
 warning("QtImageFormat QHeifHandler plugin is enabled. It is only valid under LGPL v3. More info at ...")
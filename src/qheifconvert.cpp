@@ -0,0 +1,1108 @@
+/****************************************************************************
+**
+** Copyright (C) 2018 The Qt Company Ltd.
+** Contact: https://www.qt.io/licensing/
+**
+** This file is part of the WebP plugins in the Qt ImageFormats module.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl-3.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qheifconvert_p.h"
+
+#include <QtCore/QtGlobal>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace QHeifConvert {
+
+namespace {
+
+//
+// Helpers
+//
+
+inline uint32_t loadPixel(const uchar* src)
+{
+    uint32_t pixel;
+    std::memcpy(&pixel, src, sizeof(pixel));
+    return pixel;
+}
+
+inline void storePixel(uchar* dest, uint32_t pixel)
+{
+    std::memcpy(dest, &pixel, sizeof(pixel));
+}
+
+/**
+ * Returns table of 0x10000 * 255 / alpha, for unpremultiplying.
+ */
+const uint32_t* unpremultiplyTable()
+{
+    struct Table
+    {
+        Table()
+        {
+            values[0] = 0;
+            for (uint32_t a = 1; a < 256; ++a) {
+                values[a] = (255 * 0x10000 + a / 2) / a;
+            }
+        }
+
+        uint32_t values[256];
+    };
+
+    static const Table table;
+    return table.values;
+}
+
+inline uchar unpremultiply(uint32_t value, uint32_t inverseAlpha)
+{
+    return static_cast<uchar>(qMin<uint32_t>((value * inverseAlpha + 0x8000) >> 16, 255));
+}
+
+//
+// Conversion to RGBA
+//
+
+/**
+ * Converts 0xAARRGGBB words to RGBA bytes; optionally forces opaque alpha.
+ *
+ * In little-endian words, RGBA bytes are 0xAABBGGRR, so red and blue are
+ * swapped. In big-endian words, they are 0xRRGGBBAA, a rotation.
+ */
+template<bool kOpaque>
+void argb32ToRgba(const uchar* src, uchar* dest, int width)
+{
+    const uint32_t alphaMask = kOpaque ? 0xff000000u : 0u;
+    int x = 0;
+
+#if defined(__SSE2__) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    const __m128i agMask = _mm_set1_epi32(static_cast<int>(0xff00ff00u));
+    const __m128i rbMask = _mm_set1_epi32(0x00ff00ff);
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(alphaMask));
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * x));
+        __m128i ag = _mm_and_si128(p, agMask);
+        __m128i rb = _mm_and_si128(p, rbMask);
+        rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+        p = _mm_or_si128(_mm_or_si128(ag, rb), alpha);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4 * x), p);
+    }
+#endif
+
+    for (; x < width; ++x) {
+        uint32_t p = loadPixel(src + 4 * x) | alphaMask;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        p = (p & 0xff00ff00u) | ((p >> 16) & 0xffu) | ((p & 0xffu) << 16);
+#else
+        p = (p << 8) | (p >> 24);
+#endif
+        storePixel(dest + 4 * x, p);
+    }
+}
+
+/**
+ * Converts RGBA bytes to 0xAARRGGBB words; optionally forces opaque alpha.
+ */
+template<bool kOpaque>
+void rgbaToArgb32(const uchar* src, uchar* dest, int width)
+{
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    // swapping red and blue is its own inverse
+    argb32ToRgba<kOpaque>(src, dest, width);
+#else
+    const uint32_t alphaMask = kOpaque ? 0xffu : 0u;
+
+    for (int x = 0; x < width; ++x) {
+        const uint32_t p = loadPixel(src + 4 * x) | alphaMask;
+        storePixel(dest + 4 * x, (p >> 8) | (p << 24));
+    }
+#endif
+}
+
+/**
+ * Returns round(value * alpha / 255) for value * alpha + 128.
+ */
+inline uint32_t divideBy255(uint32_t t)
+{
+    return (t + (t >> 8)) >> 8;
+}
+
+/**
+ * Converts RGBA bytes to premultiplied 0xAARRGGBB words.
+ */
+void rgbaToArgb32Premultiplied(const uchar* src, uchar* dest, int width)
+{
+    int x = 0;
+
+#if defined(__SSE2__) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alphaLanes = _mm_set_epi16(0xff, 0, 0, 0, 0xff, 0, 0, 0);
+    const __m128i half = _mm_set1_epi16(0x80);
+
+    auto premultiply = [&](__m128i p) {
+        // p holds two pixels as 16-bit channels; alpha lane is multiplied by 255
+        __m128i alpha = _mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3));
+        alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+        alpha = _mm_or_si128(alpha, alphaLanes);
+
+        __m128i t = _mm_add_epi16(_mm_mullo_epi16(p, alpha), half);
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    };
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * x));
+        __m128i lo = premultiply(_mm_unpacklo_epi8(p, zero));
+        __m128i hi = premultiply(_mm_unpackhi_epi8(p, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4 * x), _mm_packus_epi16(lo, hi));
+    }
+
+    // swap red and blue of premultiplied pixels
+    rgbaToArgb32<false>(dest, dest, x);
+#endif
+
+    for (; x < width; ++x) {
+        const uchar* s = src + 4 * x;
+        const uint32_t a = s[3];
+        const uint32_t r = divideBy255(s[0] * a + 0x80);
+        const uint32_t g = divideBy255(s[1] * a + 0x80);
+        const uint32_t b = divideBy255(s[2] * a + 0x80);
+        storePixel(dest + 4 * x, (a << 24) | (r << 16) | (g << 8) | b);
+    }
+}
+
+void argb32PremultipliedToRgba(const uchar* src, uchar* dest, int width)
+{
+    const uint32_t* inverse = unpremultiplyTable();
+
+    int x = 0;
+    while (x < width) {
+        // swizzle runs of opaque pixels in bulk
+        int runEnd = x;
+        while (runEnd < width && (loadPixel(src + 4 * runEnd) >> 24) == 0xff) {
+            ++runEnd;
+        }
+
+        argb32ToRgba<false>(src + 4 * x, dest + 4 * x, runEnd - x);
+        x = runEnd;
+
+        for (; x < width; ++x) {
+            const uint32_t p = loadPixel(src + 4 * x);
+            const uint32_t a = p >> 24;
+
+            if (a == 0xff) {
+                break;
+            }
+
+            const uint32_t inv = inverse[a];
+            uchar* d = dest + 4 * x;
+            d[0] = unpremultiply((p >> 16) & 0xff, inv);
+            d[1] = unpremultiply((p >> 8) & 0xff, inv);
+            d[2] = unpremultiply(p & 0xff, inv);
+            d[3] = static_cast<uchar>(a);
+        }
+    }
+}
+
+void rgbaPremultipliedToRgba(const uchar* src, uchar* dest, int width)
+{
+    const uint32_t* inverse = unpremultiplyTable();
+
+    for (int x = 0; x < width; ++x) {
+        const uchar* s = src + 4 * x;
+        uchar* d = dest + 4 * x;
+        const uint32_t a = s[3];
+
+        if (a == 0xff) {
+            std::copy(s, s + 4, d);
+            continue;
+        }
+
+        const uint32_t inv = inverse[a];
+        d[0] = unpremultiply(s[0], inv);
+        d[1] = unpremultiply(s[1], inv);
+        d[2] = unpremultiply(s[2], inv);
+        d[3] = static_cast<uchar>(a);
+    }
+}
+
+void rgbxToRgba(const uchar* src, uchar* dest, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        const uchar* s = src + 4 * x;
+        uchar* d = dest + 4 * x;
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+        d[3] = 0xff;
+    }
+}
+
+void rgb888ToRgba(const uchar* src, uchar* dest, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        const uchar* s = src + 3 * x;
+        uchar* d = dest + 4 * x;
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+        d[3] = 0xff;
+    }
+}
+
+void grayscale8ToRgba(const uchar* src, uchar* dest, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        uchar* d = dest + 4 * x;
+        d[0] = src[x];
+        d[1] = src[x];
+        d[2] = src[x];
+        d[3] = 0xff;
+    }
+}
+
+//
+// Conversion to RGB
+//
+
+void argb32ToRgb(const uchar* src, uchar* dest, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        const uint32_t p = loadPixel(src + 4 * x);
+        uchar* d = dest + 3 * x;
+        d[0] = static_cast<uchar>(p >> 16);
+        d[1] = static_cast<uchar>(p >> 8);
+        d[2] = static_cast<uchar>(p);
+    }
+}
+
+void rgbaToRgb(const uchar* src, uchar* dest, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        const uchar* s = src + 4 * x;
+        uchar* d = dest + 3 * x;
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+    }
+}
+
+void grayscale8ToRgb(const uchar* src, uchar* dest, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        uchar* d = dest + 3 * x;
+        d[0] = src[x];
+        d[1] = src[x];
+        d[2] = src[x];
+    }
+}
+
+//
+// Conversion from high bit depth
+//
+
+/**
+ * Scales a sample with the given number of significant bits (9 to 16) to
+ * 16 bits, by replicating high bits into the low ones.
+ */
+inline quint16 expandTo16(uint32_t value, int bits)
+{
+    return static_cast<quint16>((value << (16 - bits)) | (value >> (2 * bits - 16)));
+}
+
+inline quint16 premultiply16(uint32_t value, uint32_t alpha)
+{
+    return static_cast<quint16>((value * alpha + 0x7fff) / 0xffff);
+}
+
+//
+// Conversion from YCbCr
+//
+
+/**
+ * Returns (a * b) >> 16, like _mm_mulhi_epi16().
+ */
+inline int mulHigh(int a, int b)
+{
+    return (a * b) >> 16;
+}
+
+inline uchar clampToByte(int value)
+{
+    return static_cast<uchar>(qBound(0, value, 255));
+}
+
+/**
+ * Converts YCbCr to RGB in 13-bit fixed point. Samples are scaled by 2^6
+ * before multiplying, so results have 3 fractional bits. The SIMD version
+ * below computes exactly the same values.
+ */
+inline void yCbCrToRgb(const YCbCrMatrix& m, int y, int cb, int cr, int* r, int* g, int* b)
+{
+    const int yTerm = mulHigh((y - m.yOffset) << 6, m.yToRgb);
+    cb = (cb - 128) << 6;
+    cr = (cr - 128) << 6;
+
+    *r = clampToByte((yTerm + mulHigh(cr, m.crToR) + 4) >> 3);
+    *g = clampToByte((yTerm - mulHigh(cb, m.cbToG) - mulHigh(cr, m.crToG) + 4) >> 3);
+    *b = clampToByte((yTerm + mulHigh(cb, m.cbToB) + 4) >> 3);
+}
+
+/**
+ * Converts YCbCr rows to 4-byte pixels, in RGBX order if kSwapRedBlue is
+ * false, or as 0xffRRGGBB words otherwise.
+ */
+template<bool kSwapRedBlue>
+void yCbCrToRgbx(const YCbCrMatrix& m,
+                 const uchar* srcY,
+                 const uchar* srcCb,
+                 const uchar* srcCr,
+                 int chromaShift,
+                 uchar* dest,
+                 int width)
+{
+    int x = 0;
+
+#if defined(__SSE2__) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opaque = _mm_set1_epi8(static_cast<char>(0xff));
+    const __m128i yOffset = _mm_set1_epi16(m.yOffset);
+    const __m128i chromaOffset = _mm_set1_epi16(128);
+    const __m128i rounding = _mm_set1_epi16(4);
+    const __m128i yToRgb = _mm_set1_epi16(m.yToRgb);
+    const __m128i crToR = _mm_set1_epi16(m.crToR);
+    const __m128i cbToG = _mm_set1_epi16(m.cbToG);
+    const __m128i crToG = _mm_set1_epi16(m.crToG);
+    const __m128i cbToB = _mm_set1_epi16(m.cbToB);
+
+    // loads 8 chroma samples as 16 bits, replicating subsampled ones
+    auto loadChroma = [&](const uchar* src) {
+        __m128i c;
+        if (chromaShift) {
+            int32_t samples;
+            std::memcpy(&samples, src, sizeof(samples));
+            c = _mm_cvtsi32_si128(samples);
+            c = _mm_unpacklo_epi8(c, c);
+        } else {
+            c = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src));
+        }
+
+        c = _mm_sub_epi16(_mm_unpacklo_epi8(c, zero), chromaOffset);
+        return _mm_slli_epi16(c, 6);
+    };
+
+    auto finish = [&](__m128i value) {
+        value = _mm_srai_epi16(_mm_add_epi16(value, rounding), 3);
+        return _mm_packus_epi16(value, value);
+    };
+
+    for (; x + 8 <= width; x += 8) {
+        __m128i y = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(srcY + x));
+        y = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(y, zero), yOffset), 6);
+        y = _mm_mulhi_epi16(y, yToRgb);
+
+        const __m128i cb = loadChroma(srcCb + (x >> chromaShift));
+        const __m128i cr = loadChroma(srcCr + (x >> chromaShift));
+
+        const __m128i r = finish(_mm_add_epi16(y, _mm_mulhi_epi16(cr, crToR)));
+        const __m128i g = finish(_mm_sub_epi16(_mm_sub_epi16(y, _mm_mulhi_epi16(cb, cbToG)),
+                                               _mm_mulhi_epi16(cr, crToG)));
+        const __m128i b = finish(_mm_add_epi16(y, _mm_mulhi_epi16(cb, cbToB)));
+
+        const __m128i first = _mm_unpacklo_epi8(kSwapRedBlue ? b : r, g);
+        const __m128i second = _mm_unpacklo_epi8(kSwapRedBlue ? r : b, opaque);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4 * x),
+                         _mm_unpacklo_epi16(first, second));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4 * x + 16),
+                         _mm_unpackhi_epi16(first, second));
+    }
+#endif
+
+    for (; x < width; ++x) {
+        const int c = x >> chromaShift;
+        int r, g, b;
+        yCbCrToRgb(m, srcY[x], srcCb[c], srcCr[c], &r, &g, &b);
+
+        if (kSwapRedBlue) {
+            storePixel(dest + 4 * x, 0xff000000u | (r << 16) | (g << 8) | b);
+        } else {
+            uchar* d = dest + 4 * x;
+            d[0] = static_cast<uchar>(r);
+            d[1] = static_cast<uchar>(g);
+            d[2] = static_cast<uchar>(b);
+            d[3] = 0xff;
+        }
+    }
+}
+
+//
+// Conversion to YCbCr
+//
+
+/**
+ * Returns a chroma sample for sums of 2^shift RGB pixels, in 14-bit fixed
+ * point. The SIMD version below computes exactly the same values.
+ */
+inline uchar rgbSumToChroma(int r, int g, int b, int rCoeff, int gCoeff, int bCoeff, int shift)
+{
+    const int value = r * rCoeff + g * gCoeff + b * bCoeff + (1 << (13 + shift));
+    return clampToByte((value >> (14 + shift)) + 128);
+}
+
+#if defined(__SSE2__) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+/**
+ * Splits 4 RGBA pixels into 32-bit lanes of red | blue << 16 and
+ * green | alpha << 16, which _mm_madd_epi16() multiplies by coefficient
+ * pairs in one step.
+ */
+inline void splitRgba(__m128i pixels, __m128i* rb, __m128i* ga)
+{
+    const __m128i mask = _mm_set1_epi32(0x00ff00ff);
+    *rb = _mm_and_si128(pixels, mask);
+    *ga = _mm_and_si128(_mm_srli_epi32(pixels, 8), mask);
+}
+
+inline __m128i coefficientPair(int low, int high)
+{
+    return _mm_set1_epi32(static_cast<int>((static_cast<uint32_t>(high) << 16)
+                                           | static_cast<uint16_t>(low)));
+}
+#endif
+
+/**
+ * Returns whether all alpha bytes of a row of 4-byte pixels are 0xff.
+ */
+bool isAlphaOpaque(const uchar* src, int width, int alphaOffset)
+{
+    uchar alpha = 0xff;
+
+    for (int x = 0; x < width; ++x) {
+        alpha &= src[4 * x + alphaOffset];
+    }
+
+    return alpha == 0xff;
+}
+
+/**
+ * Returns the byte offset of alpha in pixels of formats whose colors are
+ * averaged weighted by alpha, or -1 for formats averaged per channel.
+ */
+int weightingAlphaOffset(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_ARGB32:
+        return Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? 3 : 0;
+
+    case QImage::Format_RGBA8888:
+        return 3;
+
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Returns the first of the source pixels averaged into destination pixel i.
+ */
+inline int boxStart(int i, int srcLength, int destLength)
+{
+    return static_cast<int>(static_cast<qint64>(i) * srcLength / destLength);
+}
+
+}  // namespace
+
+bool canConvertToRgba(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGB888:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+    case QImage::Format_Grayscale8:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+void convertRowToRgba(QImage::Format format, const uchar* src, uchar* dest, int width)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+        argb32ToRgba<true>(src, dest, width);
+        return;
+
+    case QImage::Format_ARGB32:
+        argb32ToRgba<false>(src, dest, width);
+        return;
+
+    case QImage::Format_ARGB32_Premultiplied:
+        argb32PremultipliedToRgba(src, dest, width);
+        return;
+
+    case QImage::Format_RGB888:
+        rgb888ToRgba(src, dest, width);
+        return;
+
+    case QImage::Format_RGBX8888:
+        rgbxToRgba(src, dest, width);
+        return;
+
+    case QImage::Format_RGBA8888:
+        std::copy(src, src + 4 * width, dest);
+        return;
+
+    case QImage::Format_RGBA8888_Premultiplied:
+        rgbaPremultipliedToRgba(src, dest, width);
+        return;
+
+    case QImage::Format_Grayscale8:
+        grayscale8ToRgba(src, dest, width);
+        return;
+
+    default:
+        Q_ASSERT_X(false, "convertRowToRgba()", "unsupported format");
+        return;
+    }
+}
+
+bool canConvertFromRgba(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+void convertRowFromRgba(QImage::Format format, const uchar* src, uchar* dest, int width)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+        rgbaToArgb32<true>(src, dest, width);
+        return;
+
+    case QImage::Format_ARGB32:
+        rgbaToArgb32<false>(src, dest, width);
+        return;
+
+    case QImage::Format_ARGB32_Premultiplied:
+        rgbaToArgb32Premultiplied(src, dest, width);
+        return;
+
+    case QImage::Format_RGBX8888:
+        rgbxToRgba(src, dest, width);
+        return;
+
+    case QImage::Format_RGBA8888:
+        std::copy(src, src + 4 * width, dest);
+        return;
+
+    default:
+        Q_ASSERT_X(false, "convertRowFromRgba()", "unsupported format");
+        return;
+    }
+}
+
+void convertRowFromRgb16(QImage::Format format,
+                         const quint16* src,
+                         bool srcHasAlpha,
+                         int bits,
+                         uchar* dest,
+                         int width)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    const int srcChannels = srcHasAlpha ? 4 : 3;
+    const bool premultiplied = format == QImage::Format_RGBA64_Premultiplied;
+    const bool opaque = !srcHasAlpha || format == QImage::Format_RGBX64;
+
+    auto* d = reinterpret_cast<quint16*>(dest);
+
+    for (int x = 0; x < width; ++x) {
+        const quint16* s = src + srcChannels * x;
+        quint16* p = d + 4 * x;
+
+        p[0] = expandTo16(s[0], bits);
+        p[1] = expandTo16(s[1], bits);
+        p[2] = expandTo16(s[2], bits);
+        p[3] = opaque ? 0xffff : expandTo16(s[3], bits);
+
+        if (premultiplied && p[3] != 0xffff) {
+            p[0] = premultiply16(p[0], p[3]);
+            p[1] = premultiply16(p[1], p[3]);
+            p[2] = premultiply16(p[2], p[3]);
+        }
+    }
+#else
+    Q_UNUSED(format);
+    Q_UNUSED(src);
+    Q_UNUSED(srcHasAlpha);
+    Q_UNUSED(bits);
+    Q_UNUSED(dest);
+    Q_UNUSED(width);
+    Q_ASSERT_X(false, "convertRowFromRgb16()", "64-bit formats unavailable");
+#endif
+}
+
+void convertRowFromGray16(const quint16* src, int bits, quint16* dest, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        dest[x] = expandTo16(src[x], bits);
+    }
+}
+
+bool findYCbCrMatrix(int matrixCoefficients, bool fullRange, YCbCrMatrix* matrix)
+{
+    // luma weights of red and blue
+    double kr = 0;
+    double kb = 0;
+
+    switch (matrixCoefficients) {
+    case 1:  // BT.709
+        kr = 0.2126;
+        kb = 0.0722;
+        break;
+
+    case 2:  // unspecified, treated as BT.601 like libheif does
+    case 5:  // BT.470 System B, G
+    case 6:  // BT.601
+        kr = 0.299;
+        kb = 0.114;
+        break;
+
+    case 4:  // FCC
+        kr = 0.30;
+        kb = 0.11;
+        break;
+
+    case 7:  // SMPTE 240M
+        kr = 0.212;
+        kb = 0.087;
+        break;
+
+    case 9:  // BT.2020 non-constant luminance
+        kr = 0.2627;
+        kb = 0.0593;
+        break;
+
+    default:
+        return false;
+    }
+
+    const double kg = 1 - kr - kb;
+    const double yScale = fullRange ? 1.0 : 255.0 / 219.0;
+    const double cScale = fullRange ? 1.0 : 255.0 / 224.0;
+
+    auto fixed13 = [](double value) {
+        return static_cast<qint16>(qRound(value * 8192));
+    };
+
+    matrix->yOffset = fullRange ? 0 : 16;
+    matrix->yToRgb = fixed13(yScale);
+    matrix->crToR = fixed13(cScale * 2 * (1 - kr));
+    matrix->cbToG = fixed13(cScale * 2 * kb * (1 - kb) / kg);
+    matrix->crToG = fixed13(cScale * 2 * kr * (1 - kr) / kg);
+    matrix->cbToB = fixed13(cScale * 2 * (1 - kb));
+
+    // rows are adjusted to sum exactly, so white and grays map exactly
+    auto fixed14 = [](double value) {
+        return static_cast<qint16>(qRound(value * 16384));
+    };
+
+    const double yScaleInv = 1 / yScale;
+    const double cScaleInv = 1 / cScale;
+
+    matrix->rToY = fixed14(yScaleInv * kr);
+    matrix->bToY = fixed14(yScaleInv * kb);
+    matrix->gToY = fixed14(yScaleInv) - matrix->rToY - matrix->bToY;
+
+    matrix->rToCb = fixed14(cScaleInv * -kr / (2 * (1 - kb)));
+    matrix->bToCb = fixed14(cScaleInv * 0.5);
+    matrix->gToCb = -matrix->rToCb - matrix->bToCb;
+
+    matrix->rToCr = fixed14(cScaleInv * 0.5);
+    matrix->bToCr = fixed14(cScaleInv * -kb / (2 * (1 - kr)));
+    matrix->gToCr = -matrix->rToCr - matrix->bToCr;
+    return true;
+}
+
+bool canConvertFromYCbCr(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+void convertRowFromYCbCr(QImage::Format format,
+                         const YCbCrMatrix& matrix,
+                         const uchar* srcY,
+                         const uchar* srcCb,
+                         const uchar* srcCr,
+                         int chromaShift,
+                         uchar* dest,
+                         int width)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        yCbCrToRgbx<true>(matrix, srcY, srcCb, srcCr, chromaShift, dest, width);
+        return;
+
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+        yCbCrToRgbx<false>(matrix, srcY, srcCb, srcCr, chromaShift, dest, width);
+        return;
+
+    default:
+        Q_ASSERT_X(false, "convertRowFromYCbCr()", "unsupported format");
+        return;
+    }
+}
+
+void convertRowToY(const YCbCrMatrix& m, const uchar* src, uchar* destY, int width)
+{
+    int x = 0;
+
+#if defined(__SSE2__) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    const __m128i rbToY = coefficientPair(m.rToY, m.bToY);
+    const __m128i gaToY = coefficientPair(m.gToY, 0);
+    const __m128i rounding = _mm_set1_epi32(1 << 13);
+    const __m128i yOffset = _mm_set1_epi16(m.yOffset);
+
+    auto luma = [&](const uchar* pixels) {
+        __m128i rb, ga;
+        splitRgba(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels)), &rb, &ga);
+        __m128i y = _mm_add_epi32(_mm_madd_epi16(rb, rbToY), _mm_madd_epi16(ga, gaToY));
+        return _mm_srai_epi32(_mm_add_epi32(y, rounding), 14);
+    };
+
+    for (; x + 8 <= width; x += 8) {
+        __m128i y = _mm_packs_epi32(luma(src + 4 * x), luma(src + 4 * x + 16));
+        y = _mm_add_epi16(y, yOffset);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(destY + x), _mm_packus_epi16(y, y));
+    }
+#endif
+
+    for (; x < width; ++x) {
+        const uchar* s = src + 4 * x;
+        const int y = s[0] * m.rToY + s[1] * m.gToY + s[2] * m.bToY + (1 << 13);
+        destY[x] = clampToByte((y >> 14) + m.yOffset);
+    }
+}
+
+void convertRowsToCbCr(const YCbCrMatrix& m,
+                       const uchar* src0,
+                       const uchar* src1,
+                       int chromaShift,
+                       uchar* destCb,
+                       uchar* destCr,
+                       int width)
+{
+    const int chromaWidth = (width + (1 << chromaShift) - 1) >> chromaShift;
+    const int shift = chromaShift + (src1 ? 1 : 0);
+    int c = 0;
+
+#if defined(__SSE2__) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    const __m128i rbToCb = coefficientPair(m.rToCb, m.bToCb);
+    const __m128i gaToCb = coefficientPair(m.gToCb, 0);
+    const __m128i rbToCr = coefficientPair(m.rToCr, m.bToCr);
+    const __m128i gaToCr = coefficientPair(m.gToCr, 0);
+    const __m128i rounding = _mm_set1_epi32(1 << (13 + shift));
+    const __m128i chromaOffset = _mm_set1_epi16(128);
+    const __m128i shiftCount = _mm_cvtsi32_si128(14 + shift);
+
+    // sums the pixels of each chroma sample, for 4 pixels
+    auto sumPixels = [&](const uchar* pixels0, const uchar* pixels1, __m128i* rb, __m128i* ga) {
+        splitRgba(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels0)), rb, ga);
+
+        if (pixels1) {
+            __m128i rb1, ga1;
+            splitRgba(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels1)), &rb1, &ga1);
+            *rb = _mm_add_epi32(*rb, rb1);
+            *ga = _mm_add_epi32(*ga, ga1);
+        }
+
+        if (chromaShift) {
+            // add odd lanes to even ones
+            *rb = _mm_add_epi32(*rb, _mm_srli_epi64(*rb, 32));
+            *ga = _mm_add_epi32(*ga, _mm_srli_epi64(*ga, 32));
+        }
+    };
+
+    auto chroma = [&](__m128i rb, __m128i ga, __m128i rbCoeff, __m128i gaCoeff) {
+        __m128i value = _mm_add_epi32(_mm_madd_epi16(rb, rbCoeff), _mm_madd_epi16(ga, gaCoeff));
+        return _mm_sra_epi32(_mm_add_epi32(value, rounding), shiftCount);
+    };
+
+    auto store = [&](uchar* dest, __m128i value) {
+        value = _mm_add_epi16(_mm_packs_epi32(value, value), chromaOffset);
+        const int32_t samples = _mm_cvtsi128_si32(_mm_packus_epi16(value, value));
+        std::memcpy(dest, &samples, sizeof(samples));
+    };
+
+    // each iteration makes 4 chroma samples
+    for (; (c + 4) << chromaShift <= width; c += 4) {
+        const int x = c << chromaShift;
+        const uchar* pixels1 = src1 ? src1 + 4 * x : nullptr;
+        __m128i rb, ga;
+
+        if (chromaShift) {
+            __m128i rbHigh, gaHigh;
+            sumPixels(src0 + 4 * x, pixels1, &rb, &ga);
+            sumPixels(src0 + 4 * x + 16, pixels1 ? pixels1 + 16 : nullptr, &rbHigh, &gaHigh);
+
+            // gather even lanes
+            rb = _mm_unpacklo_epi64(_mm_shuffle_epi32(rb, _MM_SHUFFLE(3, 1, 2, 0)),
+                                    _mm_shuffle_epi32(rbHigh, _MM_SHUFFLE(3, 1, 2, 0)));
+            ga = _mm_unpacklo_epi64(_mm_shuffle_epi32(ga, _MM_SHUFFLE(3, 1, 2, 0)),
+                                    _mm_shuffle_epi32(gaHigh, _MM_SHUFFLE(3, 1, 2, 0)));
+        } else {
+            sumPixels(src0 + 4 * x, pixels1, &rb, &ga);
+        }
+
+        store(destCb + c, chroma(rb, ga, rbToCb, gaToCb));
+        store(destCr + c, chroma(rb, ga, rbToCr, gaToCr));
+    }
+#endif
+
+    for (; c < chromaWidth; ++c) {
+        const int beginX = c << chromaShift;
+        const int endX = qMin(width, (c + 1) << chromaShift);
+        int r = 0;
+        int g = 0;
+        int b = 0;
+
+        for (int x = beginX; x < endX; ++x) {
+            const uchar* s0 = src0 + 4 * x;
+            r += s0[0];
+            g += s0[1];
+            b += s0[2];
+
+            if (src1) {
+                const uchar* s1 = src1 + 4 * x;
+                r += s1[0];
+                g += s1[1];
+                b += s1[2];
+            }
+        }
+
+        if (endX - beginX < (1 << chromaShift)) {
+            // image edge; weight the last column twice
+            const uchar* s0 = src0 + 4 * beginX;
+            r += s0[0];
+            g += s0[1];
+            b += s0[2];
+
+            if (src1) {
+                const uchar* s1 = src1 + 4 * beginX;
+                r += s1[0];
+                g += s1[1];
+                b += s1[2];
+            }
+        }
+
+        destCb[c] = rgbSumToChroma(r, g, b, m.rToCb, m.gToCb, m.bToCb, shift);
+        destCr[c] = rgbSumToChroma(r, g, b, m.rToCr, m.gToCr, m.bToCr, shift);
+    }
+}
+
+void convertRowToAlpha(const uchar* src, uchar* destAlpha, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        destAlpha[x] = src[4 * x + 3];
+    }
+}
+
+bool canDownscale(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+void sumRowBoxes(QImage::Format format,
+                 const uchar* src,
+                 int srcWidth,
+                 quint64* sums,
+                 int destWidth)
+{
+    const int alphaOffset = weightingAlphaOffset(format);
+
+    for (int i = 0; i < destWidth; ++i) {
+        const int end = boxStart(i + 1, srcWidth, destWidth);
+        quint64* sum = sums + 4 * i;
+
+        if (alphaOffset < 0) {
+            // premultiplied or opaque; channels are independent
+            for (int x = boxStart(i, srcWidth, destWidth); x < end; ++x) {
+                const uchar* pixel = src + 4 * x;
+                sum[0] += pixel[0];
+                sum[1] += pixel[1];
+                sum[2] += pixel[2];
+                sum[3] += pixel[3];
+            }
+        } else {
+            // weight colors by alpha, so transparent pixels don't bleed
+            for (int x = boxStart(i, srcWidth, destWidth); x < end; ++x) {
+                const uchar* pixel = src + 4 * x;
+                const quint32 alpha = pixel[alphaOffset];
+
+                for (int c = 0; c < 4; ++c) {
+                    sum[c] += c == alphaOffset ? alpha : pixel[c] * alpha;
+                }
+            }
+        }
+    }
+}
+
+void averageBoxes(QImage::Format format,
+                  const quint64* sums,
+                  int srcWidth,
+                  int numRows,
+                  uchar* dest,
+                  int destWidth)
+{
+    const int alphaOffset = weightingAlphaOffset(format);
+
+    for (int i = 0; i < destWidth; ++i) {
+        const quint64 count = static_cast<quint64>(numRows)
+            * (boxStart(i + 1, srcWidth, destWidth) - boxStart(i, srcWidth, destWidth));
+        const quint64* sum = sums + 4 * i;
+        uchar* pixel = dest + 4 * i;
+
+        if (alphaOffset < 0) {
+            for (int c = 0; c < 4; ++c) {
+                pixel[c] = static_cast<uchar>((sum[c] + count / 2) / count);
+            }
+        } else {
+            const quint64 alphaSum = sum[alphaOffset];
+
+            for (int c = 0; c < 4; ++c) {
+                if (c == alphaOffset) {
+                    pixel[c] = static_cast<uchar>((alphaSum + count / 2) / count);
+                } else if (alphaSum > 0) {
+                    pixel[c] = static_cast<uchar>((sum[c] + alphaSum / 2) / alphaSum);
+                } else {
+                    pixel[c] = 0;
+                }
+            }
+        }
+    }
+}
+
+bool canConvertToRgb(QImage::Format format)
+{
+    return canConvertToRgba(format);
+}
+
+void convertRowToRgb(QImage::Format format, const uchar* src, uchar* dest, int width)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        argb32ToRgb(src, dest, width);
+        return;
+
+    case QImage::Format_RGB888:
+        std::copy(src, src + 3 * width, dest);
+        return;
+
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        rgbaToRgb(src, dest, width);
+        return;
+
+    case QImage::Format_Grayscale8:
+        grayscale8ToRgb(src, dest, width);
+        return;
+
+    default:
+        Q_ASSERT_X(false, "convertRowToRgb()", "unsupported format");
+        return;
+    }
+}
+
+bool isOpaque(const QImage& image)
+{
+    if (!image.hasAlphaChannel()) {
+        return true;
+    }
+
+    int alphaOffset = 0;
+
+    switch (image.format()) {
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        // alpha is the most significant byte of a word
+        alphaOffset = Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? 3 : 0;
+        break;
+
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        alphaOffset = 3;
+        break;
+
+    default:
+        // not worth scanning other formats
+        return false;
+    }
+
+    for (int y = 0; y < image.height(); ++y) {
+        if (!isAlphaOpaque(image.constScanLine(y), image.width(), alphaOffset)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+}  // namespace QHeifConvert
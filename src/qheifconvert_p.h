@@ -0,0 +1,194 @@
+/****************************************************************************
+**
+** Copyright (C) 2018 The Qt Company Ltd.
+** Contact: https://www.qt.io/licensing/
+**
+** This file is part of the WebP plugins in the Qt ImageFormats module.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl-3.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#ifndef QHEIFCONVERT_P_H
+#define QHEIFCONVERT_P_H
+
+#include <QtGui/QImage>
+
+/**
+ * Pixel conversion between QImage formats and libheif image planes.
+ *
+ * Functions work on single rows, so callers can convert straight from one
+ * buffer into another without intermediate images.
+ */
+namespace QHeifConvert {
+
+/**
+ * Returns whether rows of the given format can be converted by
+ * convertRowToRgba().
+ */
+bool canConvertToRgba(QImage::Format format);
+
+/**
+ * Converts a row of pixels to non-premultiplied RGBA, 8 bits per channel.
+ */
+void convertRowToRgba(QImage::Format format, const uchar* src, uchar* dest, int width);
+
+/**
+ * Returns whether rows of the given format can be converted by
+ * convertRowToRgb().
+ */
+bool canConvertToRgb(QImage::Format format);
+
+/**
+ * Converts a row of pixels to RGB, 8 bits per channel. Alpha is dropped.
+ */
+void convertRowToRgb(QImage::Format format, const uchar* src, uchar* dest, int width);
+
+/**
+ * Returns whether convertRowFromRgba() can convert to the given format.
+ */
+bool canConvertFromRgba(QImage::Format format);
+
+/**
+ * Converts a row of non-premultiplied RGBA pixels, 8 bits per channel, to
+ * the given format.
+ */
+void convertRowFromRgba(QImage::Format format, const uchar* src, uchar* dest, int width);
+
+/**
+ * Converts a row of 16-bit RGB(A) samples with the given number of
+ * significant bits to a 64-bit format, scaling samples to the full range.
+ */
+void convertRowFromRgb16(QImage::Format format,
+                         const quint16* src,
+                         bool srcHasAlpha,
+                         int bits,
+                         uchar* dest,
+                         int width);
+
+/**
+ * Scales a row of 16-bit gray samples with the given number of significant
+ * bits to the full range.
+ */
+void convertRowFromGray16(const quint16* src, int bits, quint16* dest, int width);
+
+/**
+ * Fixed-point coefficients for conversion between YCbCr and RGB, for one
+ * matrix and range.
+ */
+struct YCbCrMatrix
+{
+    // YCbCr to RGB, scaled by 2^13
+    qint16 yOffset;
+    qint16 yToRgb;
+    qint16 crToR;
+    qint16 cbToG;
+    qint16 crToG;
+    qint16 cbToB;
+
+    // RGB to YCbCr, scaled by 2^14
+    qint16 rToY;
+    qint16 gToY;
+    qint16 bToY;
+    qint16 rToCb;
+    qint16 gToCb;
+    qint16 bToCb;
+    qint16 rToCr;
+    qint16 gToCr;
+    qint16 bToCr;
+};
+
+/**
+ * Gets the matrix for the given nclx matrix coefficients and range.
+ * Returns false if the matrix is not supported.
+ */
+bool findYCbCrMatrix(int matrixCoefficients, bool fullRange, YCbCrMatrix* matrix);
+
+/**
+ * Returns whether convertRowFromYCbCr() can convert to the given format.
+ */
+bool canConvertFromYCbCr(QImage::Format format);
+
+/**
+ * Converts a row of 8-bit YCbCr samples to opaque pixels of the given
+ * format. Chroma samples are horizontally subsampled by 2^chromaShift, and
+ * are replicated to upsample.
+ */
+void convertRowFromYCbCr(QImage::Format format,
+                         const YCbCrMatrix& matrix,
+                         const uchar* srcY,
+                         const uchar* srcCb,
+                         const uchar* srcCr,
+                         int chromaShift,
+                         uchar* dest,
+                         int width);
+
+/**
+ * Converts a row of RGBA pixels, 8 bits per channel, to 8-bit luma.
+ */
+void convertRowToY(const YCbCrMatrix& matrix, const uchar* src, uchar* destY, int width);
+
+/**
+ * Converts one or two rows of RGBA pixels, 8 bits per channel, to a row of
+ * 8-bit chroma samples. Chroma is horizontally subsampled by 2^chromaShift,
+ * and vertically subsampled if src1 is not null; each sample is the average
+ * of the pixels it covers.
+ */
+void convertRowsToCbCr(const YCbCrMatrix& matrix,
+                       const uchar* src0,
+                       const uchar* src1,
+                       int chromaShift,
+                       uchar* destCb,
+                       uchar* destCr,
+                       int width);
+
+/**
+ * Copies the alpha channel of a row of RGBA pixels, 8 bits per channel.
+ */
+void convertRowToAlpha(const uchar* src, uchar* destAlpha, int width);
+
+/**
+ * Returns whether rows of the given format can be downscaled by
+ * sumRowBoxes() and averageBoxes().
+ */
+bool canDownscale(QImage::Format format);
+
+/**
+ * Adds a row of srcWidth pixels to the sums of destWidth boxes that split
+ * the row evenly. Sums hold four values per box, one per byte of a pixel.
+ * Colors of non-premultiplied formats with alpha are weighted by alpha.
+ */
+void sumRowBoxes(QImage::Format format,
+                 const uchar* src,
+                 int srcWidth,
+                 quint64* sums,
+                 int destWidth);
+
+/**
+ * Converts box sums of numRows rows, added by sumRowBoxes(), to a row of
+ * destWidth pixels, each the average of its box.
+ */
+void averageBoxes(QImage::Format format,
+                  const quint64* sums,
+                  int srcWidth,
+                  int numRows,
+                  uchar* dest,
+                  int destWidth);
+
+/**
+ * Returns whether all pixels of an image are fully opaque.
+ */
+bool isOpaque(const QImage& image);
+
+}  // namespace QHeifConvert
+
+#endif  // QHEIFCONVERT_P_H
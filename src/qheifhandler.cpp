@@ -20,23 +20,90 @@
 
 #include "qheifhandler_p.h"
 
+#include "qheifconvert_p.h"
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01120000
+#include <libheif/heif_items.h>
+#include <libheif/heif_properties.h>
+#endif
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01140000
+#include <libheif/heif_sequences.h>
+#endif
+
 #include <QtGui/QImage>
+#include <QtCore/QDateTime>
+#include <QtCore/QFileInfo>
+#include <QtCore/QMutex>
+#include <QtCore/QPoint>
+#include <QtCore/QRunnable>
+#include <QtCore/QSemaphore>
 #include <QtCore/QSize>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
 #include <QtCore/QVariant>
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <limits>
 #include <memory>
 #include <type_traits>
 
 constexpr int kDefaultQuality = 50;  // TODO: maybe adjust this
+constexpr heif_chroma kDefaultChroma = heif_chroma_420;
+
+// text keys for write settings
+constexpr const char* kChromaKey = "heif-chroma";
+constexpr const char* kPresetKey = "heif-preset";
+constexpr const char* kLosslessKey = "heif-lossless";
+constexpr const char* kEncodeThreadsKey = "heif-threads";
+constexpr const char* kImageCountKey = "heif-image-count";
+constexpr const char* kBackgroundEncodeKey = "heif-background-encode";
+constexpr const char* kTileSizeKey = "heif-tile-size";
+constexpr const char* kThumbnailSizesKey = "heif-thumbnail-sizes";
+
+// text keys for read information
+constexpr const char* kDecoderKey = "heif-decoder";
+
+// environment variables for read settings
+constexpr const char* kContextCacheEnv = "QT_HEIF_CONTEXT_CACHE";
+constexpr const char* kDecodeThreadsEnv = "QT_HEIF_DECODE_THREADS";
+constexpr const char* kDecodeAheadEnv = "QT_HEIF_DECODE_AHEAD";
+constexpr const char* kPremultipliedEnv = "QT_HEIF_PREMULTIPLIED";
+constexpr const char* kLowMemoryEnv = "QT_HEIF_LOW_MEMORY";
+constexpr const char* kDecoderEnv = "QT_HEIF_DECODER";
+constexpr const char* kHdrTo8BitEnv = "QT_HEIF_HDR_TO_8BIT";
 
 QHeifHandler::QHeifHandler() :
     QImageIOHandler(),
     _device{nullptr},
     _readState{nullptr},
-    _quality{kDefaultQuality}
+    _quality{kDefaultQuality},
+    _chroma{kDefaultChroma},
+    _preset{},
+    _lossless{false},
+    _encodeThreads{0},
+    _imageCount{1},
+    _backgroundEncode{false},
+    _tileSize{0},
+    _thumbnailSizes{},
+    _clipRect{},
+    _scaledSize{},
+    _decodeThreads{qMax(0, qEnvironmentVariableIntValue(kDecodeThreadsEnv))},
+    _decodeAhead{qMax(0, qEnvironmentVariableIntValue(kDecodeAheadEnv))},
+    _premultiplied{qEnvironmentVariableIntValue(kPremultipliedEnv) != 0},
+    _hdrTo8Bit{qEnvironmentVariableIntValue(kHdrTo8BitEnv) != 0},
+    _lowMemory{qEnvironmentVariableIntValue(kLowMemoryEnv) != 0},
+    _animation{false},
+    _readReleased{false},
+    _releasedImageCount{0},
+    _releasedImageIndex{-1},
+    _releasedTransformation{0},
+    _releasedFrameDelay{0},
+    _releasedCompression{heif_compression_undefined}
 {
 }
 
@@ -54,9 +121,12 @@ void QHeifHandler::updateDevice()
     }
 
     if (device() != _device) {
-        // new device; re-read data
+        // new device; re-read data, and drop unfinished file
         _device = device();
         _readState.reset();
+        _writeState.reset();
+        _readReleased = false;
+        _animation = false;
     }
 }
 
@@ -99,6 +169,28 @@ bool QHeifHandler::canRead() const
         return false;
     }
 
+    if (_readReleased && _device == device()) {
+        // last image already read
+        return false;
+    }
+
+    if (_readState && _readState->sequence && _device == device()) {
+        // frames left; decodes the next frame
+        return const_cast<QHeifHandler*>(this)->fetchFrame();
+    }
+
+    if (_readState && _device == device()) {
+        if (_readState->imageRead) {
+            // current image already read; jump to read another
+            return false;
+        }
+
+        if (!format().isEmpty()) {
+            // already loaded; device may have been consumed
+            return true;
+        }
+    }
+
     auto mimeFormat = canReadFrom(*device());
 
     // Other image plugins set the format here. Not sure if it is really
@@ -135,6 +227,23 @@ std::unique_ptr<T, D> wrapPointer(T* ptr, D deleter)
     return std::unique_ptr<T, D>(ptr, deleter);
 }
 
+using ImageHandlePtr = std::unique_ptr<heif_image_handle,
+                                       decltype(&heif_image_handle_release)>;
+
+ImageHandlePtr getImageHandle(heif_context* context, heif_item_id id)
+{
+    heif_image_handle* handlePtr = nullptr;
+    auto error = heif_context_get_image_handle(context, id, &handlePtr);
+
+    auto handle = wrapPointer(handlePtr, heif_image_handle_release);
+    if (error.code || !handle) {
+        qDebug("getImageHandle() failed to get image handle: %s", error.message);
+        handle.reset();
+    }
+
+    return handle;
+}
+
 template<class... As>
 heif_error readContext(As... as)
 {
@@ -147,374 +256,3528 @@ heif_error readContext(As... as)
 
 }  // namespace
 
-QHeifHandler::ReadState::ReadState(QByteArray&& data,
-                                   std::shared_ptr<heif_context>&& ctx,
-                                   std::vector<heif_item_id>&& ids,
-                                   int index) :
-    fileData(std::move(data)),
-    context(std::move(ctx)),
-    idList(std::move(ids)),
-    currentIndex(index)
-{
-}
-
-void QHeifHandler::loadContext()
+/**
+ * Provides random access to device data for libheif.
+ */
+struct QHeifHandler::DeviceReader
 {
-    updateDevice();
-
-    if (!device()) {
-        return;
-    }
+    explicit DeviceReader(QIODevice* dev);
 
-    if (_readState) {
-        // context already loaded
-        return;
-    }
+    QIODevice* const device;
+    const qint64 offset;  // file start position within device
+    const qint64 size;    // file size, from offset
 
-    // read file
-    auto fileData = device()->readAll();
+#if LIBHEIF_NUMERIC_VERSION >= 0x01030000
+    static const heif_reader kReader;
 
-    if (fileData.isEmpty()) {
-        qDebug("QHeifHandler::loadContext() failed to read file data");
-        return;
-    }
+    static int64_t getPosition(void* userdata);
+    static int read(void* data, size_t numBytes, void* userdata);
+    static int seek(int64_t position, void* userdata);
+    static heif_reader_grow_status waitForFileSize(int64_t targetSize, void* userdata);
+#endif
+};
 
-    // set up new context
-    std::shared_ptr<heif_context> context(heif_context_alloc(), heif_context_free);
-    if (!context) {
-        qDebug("QHeifHandler::loadContext() failed to alloc context");
-        return;
-    }
+QHeifHandler::DeviceReader::DeviceReader(QIODevice* dev) :
+    device(dev),
+    offset(dev->pos()),
+    size(dev->size() - dev->pos())
+{
+}
 
-    auto error = readContext(context.get(),
-                             fileData.constData(), fileData.size(), nullptr);
-    if (error.code) {
-        qDebug("QHeifHandler::loadContext() failed to read context: %s", error.message);
-        return;
-    }
+#if LIBHEIF_NUMERIC_VERSION >= 0x01030000
 
-    int numImages = heif_context_get_number_of_top_level_images(context.get());
-    std::vector<heif_item_id> idList(numImages, 0);
-    int numIdsStored = heif_context_get_list_of_top_level_image_IDs(context.get(),
-                                                                    idList.data(),
-                                                                    numImages);
-    Q_UNUSED(numIdsStored);
-    Q_ASSERT(numIdsStored == numImages);
+const heif_reader QHeifHandler::DeviceReader::kReader = []() {
+    // newer libheif adds members after these, which version 1 leaves null
+    heif_reader reader{};
+    reader.reader_api_version = 1;
+    reader.get_position = &DeviceReader::getPosition;
+    reader.read = &DeviceReader::read;
+    reader.seek = &DeviceReader::seek;
+    reader.wait_for_file_size = &DeviceReader::waitForFileSize;
+    return reader;
+}();
+
+int64_t QHeifHandler::DeviceReader::getPosition(void* userdata)
+{
+    auto* reader = static_cast<DeviceReader*>(userdata);
+    return reader->device->pos() - reader->offset;
+}
 
-    // find primary image in sequence; no ordering guaranteed for id values
-    heif_item_id id{};
-    error = heif_context_get_primary_image_ID(context.get(), &id);
-    if (error.code) {
-        qDebug("QHeifHandler::loadContext() failed to get primary ID: %s", error.message);
-        return;
-    }
+int QHeifHandler::DeviceReader::read(void* data, size_t numBytes, void* userdata)
+{
+    auto* reader = static_cast<DeviceReader*>(userdata);
 
-    auto iter = std::find(idList.begin(), idList.end(), id);
-    if (iter == idList.end()) {
-        qDebug("QHeifHandler::loadContext() primary image not found in id list");
-        return;
+    if (numBytes > static_cast<quint64>(reader->size)) {
+        return 1;
     }
 
-    int currentIndex = static_cast<int>(iter - idList.begin());
+    qint64 bytesRead = reader->device->read(static_cast<char*>(data),
+                                            static_cast<qint64>(numBytes));
 
-    _readState.reset(new ReadState{std::move(fileData),
-                                   std::move(context),
-                                   std::move(idList),
-                                   currentIndex});
+    return bytesRead == static_cast<qint64>(numBytes) ? 0 : 1;
 }
 
-bool QHeifHandler::read(QImage* destImage)
+int QHeifHandler::DeviceReader::seek(int64_t position, void* userdata)
 {
-    if (!destImage) {
-        qWarning("QHeifHandler::read() QImage to read into is null");
-        return false;
-    }
-
-    loadContext();
+    auto* reader = static_cast<DeviceReader*>(userdata);
 
-    if (!_readState) {
-        qWarning("QHeifHandler::read() failed to create context");
-        return false;
+    if (position < 0 || position > reader->size) {
+        return 1;
     }
 
-    int idIndex = _readState->currentIndex;
-    Q_ASSERT(idIndex >= 0 && static_cast<size_t>(idIndex) < _readState->idList.size());
+    return reader->device->seek(reader->offset + position) ? 0 : 1;
+}
 
-    auto id = _readState->idList[idIndex];
+heif_reader_grow_status QHeifHandler::DeviceReader::waitForFileSize(int64_t targetSize,
+                                                                    void* userdata)
+{
+    auto* reader = static_cast<DeviceReader*>(userdata);
 
-    // get image handle
-    heif_image_handle* handlePtr = nullptr;
-    auto error = heif_context_get_image_handle(_readState->context.get(), id, &handlePtr);
+    return targetSize <= reader->size
+        ? heif_reader_grow_status_size_reached
+        : heif_reader_grow_status_size_beyond_eof;
+}
 
-    auto handle = wrapPointer(handlePtr, heif_image_handle_release);
-    if (error.code || !handle) {
-        qDebug("QHeifHandler::read() failed to get image handle: %s", error.message);
-        return false;
-    }
+#endif  // LIBHEIF_NUMERIC_VERSION >= 0x01030000
 
-    // decode image
-    heif_image* srcImagePtr = nullptr;
-    error = heif_decode_image(handle.get(),
-                              &srcImagePtr,
-                              heif_colorspace_RGB,
-                              heif_chroma_interleaved_RGBA,
-                              nullptr);
+namespace {
 
-    auto srcImage = wrapPointer(srcImagePtr, heif_image_release);
-    if (error.code || !srcImage) {
-        qDebug("QHeifHandler::read() failed to decode image: %s", error.message);
-        return false;
+/**
+ * Maps the file behind a device into memory, from the current position.
+ *
+ * The file is opened separately, so the mapping stays valid regardless of
+ * what happens to the device. Returns null if the device is not a file or
+ * cannot be mapped.
+ */
+std::unique_ptr<QFile> mapDeviceFile(QIODevice& device, const uchar** data, qint64* size)
+{
+    auto* deviceFile = qobject_cast<QFile*>(&device);
+    if (!deviceFile || deviceFile->fileName().isEmpty()) {
+        return nullptr;
     }
 
-    auto channel = heif_channel_interleaved;
-    QSize imgSize(heif_image_get_width(srcImage.get(), channel),
-                  heif_image_get_height(srcImage.get(), channel));
-
-    if (!imgSize.isValid()) {
-        qWarning("QHeifHandler::read() invalid image size: %d x %d",
-                 imgSize.width(), imgSize.height());
-        return false;
+    std::unique_ptr<QFile> file(new QFile(deviceFile->fileName()));
+    if (!file->open(QIODevice::ReadOnly)) {
+        return nullptr;
     }
 
-    int stride = 0;
-    const uint8_t* data = heif_image_get_plane_readonly(srcImage.get(), channel, &stride);
-
-    if (!data) {
-        qWarning("QHeifHandler::read() pixel data not found");
-        return false;
-    }
+    const qint64 offset = device.pos();
+    const qint64 mapSize = file->size() - offset;
 
-    if (stride <= 0) {
-        qWarning("QHeifHandler::read() invalid stride: %d", stride);
-        return false;
+    if (offset < 0 || mapSize <= 0) {
+        return nullptr;
     }
-    
-    // map image format
-    heif_chroma heifFormat = heif_image_get_chroma_format(srcImage.get());
-    QImage::Format qtFormat;
 
-    switch (heifFormat) {
-    case heif_chroma_interleaved_RGB: {
-        qtFormat = QImage::Format_RGB888;
-        break;
-    }
-    case heif_chroma_interleaved_RGBA: {
-        qtFormat = QImage::Format_RGBA8888;
-        break;
-    }
-    // TODO: add other formats i.e. heif_chroma_monochrome  here
-    default:
-        qtFormat = QImage::Format_RGBA8888;
+    const uchar* mapData = file->map(offset, mapSize);
+    if (!mapData) {
+        return nullptr;
     }
-    
-    // move data ownership to QImage
-    heif_image* dataImage = srcImage.release();
-
-    *destImage = QImage(
-        data, imgSize.width(), imgSize.height(),
-        stride, qtFormat,
-        [](void* img) { heif_image_release(static_cast<heif_image*>(img)); },
-        dataImage
-    );
 
-    return true;
+    *data = mapData;
+    *size = mapSize;
+    return file;
 }
 
-int QHeifHandler::currentImageNumber() const
+/**
+ * Identifies a file's contents for the context cache.
+ */
+struct ContextKey
 {
-    if (!_readState) {
-        return -1;
-    }
+    QString path;  // canonical
+    qint64 size;
+    qint64 modified;  // ms since epoch
+};
 
-    return _readState->currentIndex;
+bool operator==(const ContextKey& a, const ContextKey& b)
+{
+    return a.path == b.path && a.size == b.size && a.modified == b.modified;
 }
 
-int QHeifHandler::imageCount() const
+/**
+ * Gets the cache key of a device, which must be a file read from the start.
+ */
+bool makeContextKey(QIODevice& device, ContextKey* key)
 {
-    if (!_readState) {
-        return 0;
+    auto* file = qobject_cast<QFile*>(&device);
+    if (!file || file->fileName().isEmpty() || device.pos() != 0) {
+        return false;
     }
 
-    return static_cast<int>(_readState->idList.size());
+    const QFileInfo info(file->fileName());
+    key->path = info.canonicalFilePath();
+    key->size = info.size();
+    key->modified = info.lastModified().toMSecsSinceEpoch();
+    return !key->path.isEmpty();
 }
 
-bool QHeifHandler::jumpToImage(int index)
+/**
+ * Context of a memory-mapped file, which owns the mapping.
+ */
+struct MappedContext
 {
-    if (!_readState) {
-        return false;
+    std::unique_ptr<QFile> file;
+    std::shared_ptr<heif_context> context;  // released before file
+};
+
+/**
+ * Process-wide cache of parsed contexts of mapped files, least recently
+ * used first out. Contexts are shared with the handlers that use them, so
+ * evicting a context only releases it once those are done.
+ */
+class ContextCache
+{
+public:
+    static ContextCache& instance()
+    {
+        // never destroyed, like the encoder pool
+        static auto* cache = new ContextCache(
+            qMax(0, qEnvironmentVariableIntValue(kContextCacheEnv)));
+        return *cache;
     }
 
-    if (index < 0 || static_cast<size_t>(index) >= _readState->idList.size()) {
-        return false;
+    bool isEnabled() const
+    {
+        return _budget > 0;
     }
 
-    _readState->currentIndex = index;
-    return true;
-}
+    std::shared_ptr<heif_context> find(const ContextKey& key)
+    {
+        QMutexLocker locker(&_mutex);
 
-bool QHeifHandler::jumpToNextImage()
-{
-    if (!_readState) {
-        return false;
+        auto it = std::find_if(_entries.begin(), _entries.end(),
+                               [&](const Entry& entry) { return entry.key == key; });
+
+        if (it == _entries.end()) {
+            return nullptr;
+        }
+
+        // move to most recently used
+        std::rotate(it, it + 1, _entries.end());
+        return _entries.back().context;
     }
 
-    return jumpToImage(_readState->currentIndex + 1);
-}
+    void insert(const ContextKey& key, std::shared_ptr<heif_context> context, qint64 cost)
+    {
+        if (cost > _budget) {
+            return;
+        }
 
-namespace {
+        // released after unlocking
+        std::vector<Entry> evicted;
 
-#if LIBHEIF_NUMERIC_VERSION >= 0x01020000
-constexpr auto kWriteErrorCode = heif_error_Encoding_error;
-constexpr auto kWriteSubErrorCode = heif_suberror_Cannot_write_output_data;
-#else
-constexpr auto kWriteErrorCode = heif_error_Usage_error;
-constexpr auto kWriteSubErrorCode = heif_suberror_Unsupported_parameter;
-#endif
+        QMutexLocker locker(&_mutex);
 
-heif_error handleWrite(heif_context* ctx, const void* data, size_t size, void* device)
-{
-    Q_UNUSED(ctx);
-    Q_ASSERT(data && device);
+        auto it = std::find_if(_entries.begin(), _entries.end(),
+                               [&](const Entry& entry) { return entry.key == key; });
 
-    using I = typename std::conditional<sizeof(size_t) >= sizeof(qint64),
-                                        size_t,
-                                        qint64>::type;
+        if (it != _entries.end()) {
+            // loaded concurrently; keep the cached one
+            return;
+        }
 
-    if (static_cast<I>(size) > static_cast<I>(std::numeric_limits<qint64>::max())) {
-        return {kWriteErrorCode, kWriteSubErrorCode, "size too big"};
-    }
+        _entries.push_back({key, std::move(context), cost});
+        _cost += cost;
 
-    qint64 bytesWritten = static_cast<QIODevice*>(device)->write(
-        static_cast<const char*>(data), static_cast<qint64>(size));
+        while (_cost > _budget) {
+            _cost -= _entries.front().cost;
+            evicted.push_back(std::move(_entries.front()));
+            _entries.erase(_entries.begin());
+        }
+    }
 
-    if (bytesWritten != static_cast<qint64>(size)) {
-        return {kWriteErrorCode, kWriteSubErrorCode, "not all data written"};
+private:
+    explicit ContextCache(int budgetMiB) :
+        _budget(qint64(budgetMiB) * 1024 * 1024),
+        _cost(0)
+    {
     }
 
-    return {heif_error_Ok, heif_suberror_Unspecified, "ok"};
-}
+    struct Entry
+    {
+        ContextKey key;
+        std::shared_ptr<heif_context> context;
+        qint64 cost;  // mapped bytes
+    };
+
+    const qint64 _budget;
+
+    QMutex _mutex;
+    std::vector<Entry> _entries;  // least recently used first
+    qint64 _cost;
+};
 
 }  // namespace
 
-bool QHeifHandler::write(const QImage& preConvSrcImage)
+/**
+ * Frames of a sequence track, decoded in order. Frames may be decoded ahead
+ * by pool threads, one at a time, since a track can only be decoded
+ * sequentially.
+ */
+struct QHeifHandler::SequenceState
 {
-    updateDevice();
+    using FramePtr = std::unique_ptr<heif_image, decltype(&heif_image_release)>;
+
+    /**
+     * A decoded frame, not yet read.
+     */
+    struct Frame
+    {
+        FramePtr image;
+        int delay;  // ms
+    };
+
+    ~SequenceState();
+
+    /**
+     * Decodes the next frame of the track and queues it. Returns false at
+     * the end of the track, or on failure. Thread-safe.
+     */
+    bool decodeNext();
+
+    /**
+     * Moves the oldest queued frame to nextFrame. Returns false if no frame
+     * is queued.
+     */
+    bool takeDecoded();
+
+    /**
+     * Returns the number of queued frames, or -1 once the track has ended.
+     */
+    int numDecoded();
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01140000
+    std::unique_ptr<heif_track, decltype(&heif_track_release)> track{nullptr,
+                                                                     heif_track_release};
+#endif
+    quint32 timescale{};  // track time units per second
+    QSize size;
+    bool hasAlpha{};
 
-    if (!device()) {
-        qWarning("QHeifHandler::write() device null before write");
-        return false;
-    }
+    // decoding settings
+    bool hdrTo8Bit{};
+    QByteArray decoderId;  // empty for libheif's choice
 
-    if (preConvSrcImage.isNull()) {
-        qWarning("QHeifHandler::write() source image is null");
-        return false;
-    }
+    // held while decoding; guards track, and writes to ended
+    QMutex decodeMutex;
+    std::atomic<bool> ended{false};  // all frames decoded
 
-    const QImage srcImage = preConvSrcImage.convertToFormat(QImage::Format_RGBA8888);
-    const QSize size = srcImage.size();
+    // held briefly, so the reader doesn't wait for frames being decoded
+    QMutex mutex;  // guards frames
+    std::deque<Frame> frames;  // decoded ahead, oldest first
 
-    if (srcImage.isNull() || !size.isValid()) {
-        qWarning("QHeifHandler::write() source image format conversion failed");
-        return false;
-    }
+    std::vector<std::shared_ptr<FrameJob>> jobs;  // decoding ahead
 
-    // create dest image
-    heif_image* destImagePtr = nullptr;
-    auto error = heif_image_create(size.width(), size.height(),
-                                   heif_colorspace_RGB, heif_chroma_interleaved_RGBA,
-                                   &destImagePtr);
+    // fetched by canRead(), and converted when read; null if not fetched yet
+    FramePtr nextFrame{nullptr, heif_image_release};
+    int nextFrameDelay{};  // ms
 
-    auto destImage = wrapPointer(destImagePtr, heif_image_release);
-    if (error.code || !destImage) {
-        qWarning("QHeifHandler::write() dest image creation failed: %s", error.message);
-        return false;
-    }
+    int frameIndex{};  // index of the frame read next
+    int frameDelay{};  // ms, of the last frame read
+};
 
-    // add rgba plane
-    auto channel = heif_channel_interleaved;
-    error = heif_image_add_plane(destImage.get(), channel,
-                                 size.width(), size.height(), 32);
+QHeifHandler::ReadState::ReadState(QByteArray&& data,
+                                   std::unique_ptr<QFile>&& file,
+                                   std::unique_ptr<DeviceReader>&& reader,
+                                   std::shared_ptr<heif_context>&& ctx,
+                                   std::vector<heif_item_id>&& ids,
+                                   int index) :
+    fileData(std::move(data)),
+    mappedFile(std::move(file)),
+    deviceReader(std::move(reader)),
+    context(std::move(ctx)),
+    idList(std::move(ids)),
+    currentIndex(index)
+{
+}
 
-    if (error.code) {
-        qWarning("QHeifHandler::write() failed to add image plane: %s", error.message);
-        return false;
+std::shared_ptr<heif_context> QHeifHandler::readContextFromDevice(
+    QByteArray* fileData,
+    std::unique_ptr<QFile>* mappedFile,
+    std::unique_ptr<DeviceReader>* deviceReader)
+{
+    std::shared_ptr<heif_context> context(heif_context_alloc(), heif_context_free);
+    if (!context) {
+        qDebug("QHeifHandler::readContextFromDevice() failed to alloc context");
+        return nullptr;
     }
 
-    // get dest data
-    int destStride = 0;
-    uint8_t* destData = heif_image_get_plane(destImage.get(), channel, &destStride);
-
-    if (!destData) {
-        qWarning("QHeifHandler::write() could not get libheif image plane");
-        return false;
+#if LIBHEIF_NUMERIC_VERSION >= 0x010d0000
+    if (_decodeThreads > 0) {
+        // a single thread means decoding in the calling thread
+        heif_context_set_max_decoding_threads(context.get(),
+                                              _decodeThreads > 1 ? _decodeThreads : 0);
     }
+#endif
 
-    if (destStride <= 0) {
-        qWarning("QHeifHandler::write() invalid destination stride: %d", destStride);
-        return false;
-    }
+    heif_error error{};
 
-    // get source data
-    const uint8_t* srcData = srcImage.constBits();
-    const int srcStride = srcImage.bytesPerLine();
+    const uchar* mappedData = nullptr;
+    qint64 mappedSize = 0;
+    *mappedFile = mapDeviceFile(*device(), &mappedData, &mappedSize);
 
-    if (!srcData) {
-        qWarning("QHeifHandler::write() source image data is null");
-        return false;
+    if (*mappedFile) {
+        // use mapped file directly, without copying
+        error = readContext(context.get(), mappedData, mappedSize, nullptr);
     }
 
-    if (srcStride <= 0) {
-        qWarning("QHeifHandler::write() invalid source image stride: %d", srcStride);
-        return false;
-    } else if (srcStride > destStride) {
-        qWarning("QHeifHandler::write() source line larger than destination");
-        return false;
+#if LIBHEIF_NUMERIC_VERSION >= 0x01030000
+    if (!*mappedFile && !device()->isSequential()) {
+        // let libheif read only what it needs
+        deviceReader->reset(new DeviceReader(device()));
+        error = heif_context_read_from_reader(context.get(),
+                                              &DeviceReader::kReader,
+                                              deviceReader->get(),
+                                              nullptr);
     }
+#endif
 
-    // copy rgba data
-    for (int y = 0; y < size.height(); ++y) {
-        auto* srcBegin = srcData + y * srcStride;
-        auto* srcEnd = srcBegin + srcStride;
-        std::copy(srcBegin, srcEnd, destData + y * destStride);
-    }
+    if (!*mappedFile && !*deviceReader) {
+        // read file
+        *fileData = device()->readAll();
 
-    // get encoder
-    heif_encoder* encoderPtr = nullptr;
-    error = heif_context_get_encoder_for_format(nullptr, heif_compression_HEVC,
-                                                &encoderPtr);
+        if (fileData->isEmpty()) {
+            qDebug("QHeifHandler::readContextFromDevice() failed to read file data");
+            return nullptr;
+        }
 
-    auto encoder = wrapPointer(encoderPtr, heif_encoder_release);
-    if (error.code || !encoder) {
-        qWarning("QHeifHandler::write() failed to get encoder: %s", error.message);
-        return false;
+        error = readContext(context.get(),
+                            fileData->constData(), fileData->size(), nullptr);
     }
 
-    error = heif_encoder_set_lossy_quality(encoder.get(), _quality);
     if (error.code) {
-        qWarning("QHeifHandler::write() failed to set quality: %s", error.message);
-        return false;
+        qDebug("QHeifHandler::readContextFromDevice() failed to read context: %s",
+               error.message);
+        return nullptr;
     }
 
-    // encode image
-    auto context = wrapPointer(heif_context_alloc(), heif_context_free);
-    if (!context) {
-        qWarning("QHeifHandler::write() failed to alloc context");
-        return false;
-    }
+    return context;
+}
 
-    heif_image_handle* handlePtr = nullptr;
-    error = heif_context_encode_image(context.get(), destImage.get(), encoder.get(),
-                                      nullptr, &handlePtr);
+void QHeifHandler::loadContext()
+{
+    updateDevice();
+
+    if (!device()) {
+        return;
+    }
+
+    if (_readState || _readReleased) {
+        // context already loaded, or released after the last image
+        return;
+    }
+
+    // brand is peeked before the device is read
+    const Format fileFormat = canReadFrom(*device());
+
+    QByteArray fileData;
+    std::unique_ptr<QFile> mappedFile;
+    std::unique_ptr<DeviceReader> deviceReader;
+
+    // try the cache
+    ContextKey cacheKey;
+    bool cacheable = ContextCache::instance().isEnabled()
+        && makeContextKey(*device(), &cacheKey);
+
+    std::shared_ptr<heif_context> context;
+
+    if (cacheable) {
+        context = ContextCache::instance().find(cacheKey);
+    }
+
+    if (!context) {
+        context = readContextFromDevice(&fileData, &mappedFile, &deviceReader);
+
+        if (!context) {
+            return;
+        }
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01140000
+        // tracks keep their decoding position in the context, so it can't be shared
+        if (heif_context_has_sequence(context.get())) {
+            cacheable = false;
+        }
+#endif
+
+        if (cacheable && mappedFile) {
+            // the cached context owns the mapping
+            const qint64 cost = mappedFile->size();
+
+            std::shared_ptr<MappedContext> mapped(new MappedContext);
+            mapped->file = std::move(mappedFile);
+            mapped->context = std::move(context);
+
+            context = std::shared_ptr<heif_context>(mapped, mapped->context.get());
+            ContextCache::instance().insert(cacheKey, context, cost);
+        }
+    }
+
+    int numImages = heif_context_get_number_of_top_level_images(context.get());
+    std::vector<heif_item_id> idList(numImages, 0);
+    int numIdsStored = heif_context_get_list_of_top_level_image_IDs(context.get(),
+                                                                    idList.data(),
+                                                                    numImages);
+    Q_UNUSED(numIdsStored);
+    Q_ASSERT(numIdsStored == numImages);
+
+    heif_item_id id{};
+    auto error = heif_context_get_primary_image_ID(context.get(), &id);
+
+    const bool sequenceBrand = fileFormat == Format::HeifSequence
+        || fileFormat == Format::HeicSequence;
+
+    // frames of a sequence track are read instead of still images for
+    // sequence brands; other files only carry tracks alongside their images
+    std::unique_ptr<SequenceState> sequence;
+
+    if (sequenceBrand || error.code) {
+        sequence = openSequence(context.get());
+    }
+
+    int currentIndex = 0;
+
+    if (!sequence) {
+        // find primary image in sequence; no ordering guaranteed for id values
+        if (error.code) {
+            qDebug("QHeifHandler::loadContext() failed to get primary ID: %s",
+                   error.message);
+            return;
+        }
+
+        auto iter = std::find(idList.begin(), idList.end(), id);
+        if (iter == idList.end()) {
+            qDebug("QHeifHandler::loadContext() primary image not found in id list");
+            return;
+        }
+
+        currentIndex = static_cast<int>(iter - idList.begin());
+    }
+
+    _animation = sequenceBrand || sequence;
+
+    _readState.reset(new ReadState{std::move(fileData),
+                                   std::move(mappedFile),
+                                   std::move(deviceReader),
+                                   std::move(context),
+                                   std::move(idList),
+                                   currentIndex});
+
+    _readState->sequence = std::move(sequence);
+    _readState->fileFormat = fileFormat;
+}
+
+namespace {
+
+using ImagePtr = std::unique_ptr<heif_image, decltype(&heif_image_release)>;
+
+class FunctionRunnable : public QRunnable
+{
+public:
+    explicit FunctionRunnable(std::function<void()> func) :
+        _func(std::move(func))
+    {
+        setAutoDelete(true);
+    }
+
+    void run() override
+    {
+        _func();
+    }
+
+private:
+    std::function<void()> _func;
+};
+
+/**
+ * Work that may be done ahead of time on a pool thread.
+ *
+ * A job is run exactly once, either by a pool thread or by the thread
+ * needing its result, whichever comes first, so waiting on a job never
+ * depends on a free pool thread. Subclasses do their work in run().
+ */
+class BackgroundJob
+{
+public:
+    enum State
+    {
+        Queued,
+        Running,
+        Done,
+        Canceled,
+    };
+
+    BackgroundJob() :
+        state(Queued),
+        _finished()
+    {
+    }
+
+    virtual ~BackgroundJob() = default;
+
+    BackgroundJob(const BackgroundJob& job) = delete;
+    BackgroundJob& operator=(const BackgroundJob& job) = delete;
+
+    /**
+     * Runs job if it has not started yet.
+     */
+    void tryRun()
+    {
+        int expected = Queued;
+        if (!state.compare_exchange_strong(expected, Running)) {
+            return;
+        }
+
+        run();
+
+        state = Done;
+        _finished.release();
+    }
+
+    /**
+     * Prevents job from starting, if it has not started yet.
+     */
+    void cancel()
+    {
+        int expected = Queued;
+        state.compare_exchange_strong(expected, Canceled);
+    }
+
+    /**
+     * Waits until job is done, if it has started.
+     */
+    void wait()
+    {
+        int current = state;
+        if (current == Running || current == Done) {
+            // leave semaphore available for other waiters
+            _finished.acquire();
+            _finished.release();
+        }
+    }
+
+    std::atomic<int> state;
+
+protected:
+    /**
+     * Does the work of the job. Called once, by tryRun().
+     */
+    virtual void run() = 0;
+
+private:
+    QSemaphore _finished;
+};
+
+/**
+ * Calls func(i) for each i in [0, count), on up to maxThreads threads.
+ *
+ * The calling thread does part of the work. Helper threads are taken from
+ * the global thread pool, but only if they are free, so a busy pool never
+ * delays the caller. Returns after all calls have finished.
+ */
+template<class F>
+void parallelFor(int count, int maxThreads, const F& func)
+{
+    std::atomic<int> nextIndex{0};
+    QSemaphore helpersDone;
+
+    auto work = [&]() {
+        for (int i = nextIndex++; i < count; i = nextIndex++) {
+            func(i);
+        }
+    };
+
+    int numHelpers = 0;
+    const int maxHelpers = qMin(maxThreads, count) - 1;
+    auto* pool = QThreadPool::globalInstance();
+
+    while (numHelpers < maxHelpers) {
+        auto* runnable = new FunctionRunnable([&]() {
+            work();
+            helpersDone.release();
+        });
+
+        if (!pool->tryStart(runnable)) {
+            delete runnable;
+            break;
+        }
+
+        ++numHelpers;
+    }
+
+    work();
+    helpersDone.acquire(numHelpers);
+}
+
+/**
+ * Settings that apply to decoding.
+ */
+struct DecodeSettings
+{
+    int threads;  // max threads for decoding tiles
+    bool premultiplied;  // produce formats that are ready for painting
+    bool ignoreTransformations;  // decode as stored, leaving transformation to Qt
+    int transformation;  // QImageIOHandler::Transformations left to Qt
+    bool hdrTo8Bit;  // read images with more than 8 bits per channel as 8-bit
+    QByteArray decoderId;  // empty for libheif's choice
+};
+
+/**
+ * Returns the id of the decoder selected with QT_HEIF_DECODER, or an empty
+ * id to let libheif choose. Unknown ids are reported once, and ignored.
+ */
+QByteArray selectedDecoderId()
+{
+    static const QByteArray id = []() -> QByteArray {
+        const QByteArray name = qgetenv(kDecoderEnv);
+        if (name.isEmpty()) {
+            return {};
+        }
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x010f0000
+        constexpr int kMaxDecoders = 32;
+        const heif_decoder_descriptor* decoders[kMaxDecoders];
+        const int numDecoders = heif_get_decoder_descriptors(heif_compression_undefined,
+                                                             decoders, kMaxDecoders);
+
+        for (int i = 0; i < numDecoders; ++i) {
+            if (name == heif_decoder_descriptor_get_id_name(decoders[i])) {
+                return name;
+            }
+        }
+
+        qWarning("selectedDecoderId() decoder not installed: %s", name.constData());
+#else
+        qWarning("selectedDecoderId() decoder selection requires libheif 1.15");
+#endif
+        return {};
+    }();
+
+    return id;
+}
+
+/**
+ * Returns the compression format implied by a file's brand, or
+ * heif_compression_undefined if the brand allows any.
+ */
+heif_compression_format brandCompression(QHeifHandler::Format fileFormat)
+{
+    return fileFormat == QHeifHandler::Format::Heic
+            || fileFormat == QHeifHandler::Format::HeicSequence
+        ? heif_compression_HEVC
+        : heif_compression_undefined;
+}
+
+constexpr uint32_t fourcc(const char* code)
+{
+    return static_cast<uint32_t>(static_cast<uchar>(code[0])) << 24
+        | static_cast<uint32_t>(static_cast<uchar>(code[1])) << 16
+        | static_cast<uint32_t>(static_cast<uchar>(code[2])) << 8
+        | static_cast<uint32_t>(static_cast<uchar>(code[3]));
+}
+
+/**
+ * Returns the compression format of an image item. Grid images report the
+ * format of their tiles. Derived images that can't be resolved fall back to
+ * the brand's format. Returns heif_compression_undefined if unknown, or if
+ * the item is not compressed with a decoder plugin.
+ */
+heif_compression_format itemCompression(heif_context* context,
+                                        heif_item_id id,
+                                        QHeifHandler::Format fileFormat)
+{
+#if LIBHEIF_NUMERIC_VERSION >= 0x01120000
+    uint32_t type = heif_item_get_item_type(context, id);
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01130000
+    if (type == fourcc("grid")) {
+        // tiles all have the same format
+        auto handle = getImageHandle(context, id);
+        heif_item_id tileId{};
+
+        if (handle
+            && !heif_image_handle_get_grid_image_tile_id(handle.get(), 0, 0, 0, &tileId).code) {
+            type = heif_item_get_item_type(context, tileId);
+        }
+    }
+#endif
+
+    switch (type) {
+    case fourcc("hvc1"):
+        return heif_compression_HEVC;
+    case fourcc("avc1"):
+        return heif_compression_AVC;
+    case fourcc("av01"):
+        return heif_compression_AV1;
+    case fourcc("vvc1"):
+        return heif_compression_VVC;
+    case fourcc("j2k1"):
+        return heif_compression_JPEG2000;
+    case fourcc("jpeg"):
+        return heif_compression_JPEG;
+
+    case 0:
+    case fourcc("grid"):
+    case fourcc("iden"):
+    case fourcc("iovl"):
+        // unknown or derived; use the brand
+        break;
+
+    default:
+        return heif_compression_undefined;
+    }
+#else
+    Q_UNUSED(context);
+    Q_UNUSED(id);
+#endif
+
+    return brandCompression(fileFormat);
+}
+
+/**
+ * Returns the id of the decoder used for images of the given compression
+ * format with the given settings, or an empty id if unknown.
+ */
+QByteArray usedDecoderId(const DecodeSettings& settings, heif_compression_format compression)
+{
+    if (compression == heif_compression_undefined) {
+        return {};
+    }
+
+    if (!settings.decoderId.isEmpty()) {
+        return settings.decoderId;
+    }
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x010f0000
+    // libheif lists decoders by priority, and uses the first
+    const heif_decoder_descriptor* decoder = nullptr;
+    if (heif_get_decoder_descriptors(compression, &decoder, 1) == 1) {
+        return heif_decoder_descriptor_get_id_name(decoder);
+    }
+#endif
+
+    return {};
+}
+
+/**
+ * Finds the rotation and mirroring that libheif applies when decoding an
+ * item, as QImageIOHandler::Transformations. Returns false if they can't be
+ * left to Qt, because the item is also cropped, or libheif or Qt is too old.
+ */
+bool findTransformation(const heif_context* context, heif_item_id id, int* transformation)
+{
+#if LIBHEIF_NUMERIC_VERSION >= 0x01120000 && QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    // orientation as a matrix mapping (x, y) to (xx x + xy y, yx x + yy y)
+    struct Orientation
+    {
+        int xx, xy, yx, yy;
+
+        Orientation then(const Orientation& o) const
+        {
+            return {o.xx * xx + o.xy * yx, o.xx * xy + o.xy * yy,
+                    o.yx * xx + o.yy * yx, o.yx * xy + o.yy * yy};
+        }
+
+        bool operator==(const Orientation& o) const
+        {
+            return xx == o.xx && xy == o.xy && yx == o.yx && yy == o.yy;
+        }
+    };
+
+    const Orientation kIdentity{1, 0, 0, 1};
+    const Orientation kMirror{-1, 0, 0, 1};
+    const Orientation kFlip{1, 0, 0, -1};
+    const Orientation kRotate90{0, -1, 1, 0};  // clockwise, y pointing down
+
+    constexpr int kMaxProperties = 8;
+    heif_property_id properties[kMaxProperties];
+    const int numProperties = heif_item_get_transformation_properties(context, id,
+                                                                      properties,
+                                                                      kMaxProperties);
+
+    if (numProperties >= kMaxProperties) {
+        return false;
+    }
+
+    // compose transformations in the order libheif applies them
+    Orientation orientation = kIdentity;
+
+    for (int i = 0; i < numProperties; ++i) {
+        switch (heif_item_get_property_type(context, id, properties[i])) {
+        case heif_item_property_type_transform_mirror: {
+            auto direction = heif_item_get_property_transform_mirror(context, id,
+                                                                     properties[i]);
+            if (direction == heif_transform_mirror_direction_horizontal) {
+                orientation = orientation.then(kMirror);
+            } else if (direction == heif_transform_mirror_direction_vertical) {
+                orientation = orientation.then(kFlip);
+            } else {
+                return false;
+            }
+            break;
+        }
+
+        case heif_item_property_type_transform_rotation: {
+            // counterclockwise angle; three clockwise turns make one
+            const int angle = heif_item_get_property_transform_rotation_ccw(context, id,
+                                                                             properties[i]);
+            if (angle < 0 || angle % 90 != 0) {
+                return false;
+            }
+
+            for (int turn = 0; turn < (360 - angle % 360) / 90 % 4; ++turn) {
+                orientation = orientation.then(kRotate90);
+            }
+            break;
+        }
+
+        default:
+            // cropping can't be expressed as a transformation
+            return false;
+        }
+    }
+
+    // Qt mirrors and flips first, then rotates
+    for (int t = QImageIOHandler::TransformationNone;
+         t <= QImageIOHandler::TransformationRotate270;
+         ++t) {
+        Orientation candidate = kIdentity;
+
+        if (t & QImageIOHandler::TransformationMirror) {
+            candidate = candidate.then(kMirror);
+        }
+        if (t & QImageIOHandler::TransformationFlip) {
+            candidate = candidate.then(kFlip);
+        }
+        if (t & QImageIOHandler::TransformationRotate90) {
+            candidate = candidate.then(kRotate90);
+        }
+
+        if (candidate == orientation) {
+            if (transformation) {
+                *transformation = t;
+            }
+            return true;
+        }
+    }
+
+    return false;
+#else
+    Q_UNUSED(context);
+    Q_UNUSED(id);
+    Q_UNUSED(transformation);
+    return false;
+#endif
+}
+
+/**
+ * Returns the size of images decoded from a handle with the given settings.
+ */
+QSize decodedSize(const heif_image_handle* handle, const DecodeSettings& settings)
+{
+#if LIBHEIF_NUMERIC_VERSION >= 0x01120000
+    if (settings.ignoreTransformations) {
+        // size as stored, before rotation
+        return QSize(heif_image_handle_get_ispe_width(handle),
+                     heif_image_handle_get_ispe_height(handle));
+    }
+#else
+    Q_UNUSED(settings);
+#endif
+
+    return QSize(heif_image_handle_get_width(handle),
+                 heif_image_handle_get_height(handle));
+}
+
+using DecodingOptionsPtr = std::unique_ptr<heif_decoding_options,
+                                           decltype(&heif_decoding_options_free)>;
+
+/**
+ * Creates decoding options for the given settings. Returns null if
+ * libheif's defaults apply.
+ */
+DecodingOptionsPtr decodingOptions(const DecodeSettings& settings)
+{
+    DecodingOptionsPtr options(nullptr, heif_decoding_options_free);
+
+    if (!settings.ignoreTransformations && !settings.hdrTo8Bit
+        && settings.decoderId.isEmpty()) {
+        return options;
+    }
+
+    options.reset(heif_decoding_options_alloc());
+    if (!options) {
+        qWarning("decodingOptions() failed to alloc options");
+        return options;
+    }
+
+    options->ignore_transformations = settings.ignoreTransformations;
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01070000
+    options->convert_hdr_to_8bit = settings.hdrTo8Bit;
+#endif
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x010f0000
+    if (!settings.decoderId.isEmpty()) {
+        // must outlive options
+        options->decoder_id = settings.decoderId.constData();
+    }
+#endif
+
+    return options;
+}
+
+/**
+ * Returns the format of images produced by read() for the given handle.
+ */
+QImage::Format readFormat(const heif_image_handle* handle, const DecodeSettings& settings)
+{
+    const bool hasAlpha = heif_image_handle_has_alpha_channel(handle);
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01070000
+    // libheif reduces samples to 8 bits while decoding
+    const int bits = settings.hdrTo8Bit ? 8
+                                        : heif_image_handle_get_luma_bits_per_pixel(handle);
+#elif LIBHEIF_NUMERIC_VERSION >= 0x01040000
+    const int bits = heif_image_handle_get_luma_bits_per_pixel(handle);
+#else
+    const int bits = 8;
+#endif
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01100000
+    heif_colorspace colorspace = heif_colorspace_undefined;
+    heif_chroma chroma = heif_chroma_undefined;
+    auto error = heif_image_handle_get_preferred_decoding_colorspace(handle,
+                                                                     &colorspace,
+                                                                     &chroma);
+
+    if (!error.code && colorspace == heif_colorspace_monochrome && !hasAlpha) {
+        if (bits <= 8) {
+            return QImage::Format_Grayscale8;
+        }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+        return QImage::Format_Grayscale16;
+#endif
+    }
+#endif
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    if (bits > 8) {
+        if (!hasAlpha) {
+            return QImage::Format_RGBX64;
+        }
+
+        return settings.premultiplied ? QImage::Format_RGBA64_Premultiplied
+                                      : QImage::Format_RGBA64;
+    }
+#else
+    Q_UNUSED(bits);
+#endif
+
+    if (settings.premultiplied) {
+        return hasAlpha ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32;
+    } else {
+        // libheif fills in opaque alpha if there is no alpha channel
+        return hasAlpha ? QImage::Format_RGBA8888 : QImage::Format_RGBX8888;
+    }
+}
+
+/**
+ * Colorspace and chroma to decode into, for producing the given format.
+ */
+struct DecodeFormat
+{
+    heif_colorspace colorspace;
+    heif_chroma chroma;
+};
+
+DecodeFormat decodeFormat(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_Grayscale8:
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+    case QImage::Format_Grayscale16:
+#endif
+        return {heif_colorspace_monochrome, heif_chroma_monochrome};
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0) && LIBHEIF_NUMERIC_VERSION >= 0x01040000
+    // 16-bit samples in host byte order
+    case QImage::Format_RGBX64:
+        return {heif_colorspace_RGB,
+                Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? heif_chroma_interleaved_RRGGBB_LE
+                                                : heif_chroma_interleaved_RRGGBB_BE};
+
+    case QImage::Format_RGBA64:
+    case QImage::Format_RGBA64_Premultiplied:
+        return {heif_colorspace_RGB,
+                Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? heif_chroma_interleaved_RRGGBBAA_LE
+                                                : heif_chroma_interleaved_RRGGBBAA_BE};
+#endif
+
+    default:
+        return {heif_colorspace_RGB, heif_chroma_interleaved_RGBA};
+    }
+}
+
+/**
+ * Finds the smallest thumbnail of an image that is at least minSize, when
+ * decoded with the given settings. Returns null if the image has no such
+ * thumbnail.
+ */
+ImageHandlePtr findThumbnail(const heif_context* context,
+                             const heif_image_handle* handle,
+                             const QSize& minSize,
+                             const DecodeSettings& settings)
+{
+    ImageHandlePtr bestThumb(nullptr, heif_image_handle_release);
+
+    int numThumbs = heif_image_handle_get_number_of_thumbnails(handle);
+    if (numThumbs <= 0) {
+        return bestThumb;
+    }
+
+    std::vector<heif_item_id> thumbIds(numThumbs, 0);
+    numThumbs = heif_image_handle_get_list_of_thumbnail_IDs(handle,
+                                                            thumbIds.data(),
+                                                            numThumbs);
+
+    qint64 bestArea = std::numeric_limits<qint64>::max();
+
+    for (int i = 0; i < numThumbs; ++i) {
+        heif_image_handle* thumbPtr = nullptr;
+        auto error = heif_image_handle_get_thumbnail(handle, thumbIds[i], &thumbPtr);
+
+        auto thumb = wrapPointer(thumbPtr, heif_image_handle_release);
+        if (error.code || !thumb) {
+            qDebug("findThumbnail() failed to get thumbnail handle: %s", error.message);
+            continue;
+        }
+
+        // thumbnail must be stored in the same orientation as its image
+        int transformation = 0;
+        if (settings.ignoreTransformations
+            && (!findTransformation(context, thumbIds[i], &transformation)
+                || transformation != settings.transformation)) {
+            continue;
+        }
+
+        const QSize size = decodedSize(thumb.get(), settings);
+        const int width = size.width();
+        const int height = size.height();
+
+        if (width < minSize.width() || height < minSize.height()) {
+            continue;
+        }
+
+        qint64 area = static_cast<qint64>(width) * height;
+        if (area < bestArea) {
+            bestArea = area;
+            bestThumb = std::move(thumb);
+        }
+    }
+
+    return bestThumb;
+}
+
+/**
+ * Maps a rectangle from an image of one size to the same region of a
+ * differently sized version of the image, rounding outward.
+ */
+QRect mapRect(const QRect& rect, const QSize& from, const QSize& to)
+{
+    auto mapDown = [](int v, int fromLen, int toLen) {
+        return static_cast<int>(static_cast<qint64>(v) * toLen / fromLen);
+    };
+
+    auto mapUp = [](int v, int fromLen, int toLen) {
+        return static_cast<int>((static_cast<qint64>(v) * toLen + fromLen - 1) / fromLen);
+    };
+
+    int left = mapDown(rect.x(), from.width(), to.width());
+    int top = mapDown(rect.y(), from.height(), to.height());
+    int right = mapUp(rect.x() + rect.width(), from.width(), to.width());
+    int bottom = mapUp(rect.y() + rect.height(), from.height(), to.height());
+
+    return QRect(left, top, right - left, bottom - top);
+}
+
+/**
+ * Returns an image of the given size and format. The buffer of *reuse is
+ * taken over if it matches and is not shared, leaving *reuse null;
+ * otherwise, a new image is allocated. reuse may be null.
+ *
+ * *reuse is the caller's image, which must survive failed reads, so it is
+ * only taken once decoding has succeeded and nothing can fail anymore.
+ */
+QImage allocImage(QImage* reuse, const QSize& size, QImage::Format format)
+{
+    if (reuse && reuse->isDetached()
+        && reuse->size() == size && reuse->format() == format) {
+        QImage image = std::move(*reuse);
+        *reuse = QImage();
+        return image;
+    }
+
+    return QImage(size, format);
+}
+
+/**
+ * Converts decoded image data to a QImage of the given format.
+ *
+ * If the format matches the decoded data, the data is wrapped without
+ * copying, and the QImage takes ownership of the heif image. Otherwise, the
+ * heif image is converted into a QImage, reusing the buffer of *reuse if
+ * possible (see allocImage()), and released.
+ */
+QImage convertImage(ImagePtr srcImage, QImage::Format format, QImage* reuse)
+{
+    const heif_chroma heifFormat = heif_image_get_chroma_format(srcImage.get());
+    const auto channel = heifFormat == heif_chroma_monochrome ? heif_channel_Y
+                                                              : heif_channel_interleaved;
+
+    QSize imgSize(heif_image_get_width(srcImage.get(), channel),
+                  heif_image_get_height(srcImage.get(), channel));
+
+    if (!imgSize.isValid()) {
+        qWarning("convertImage() invalid image size: %d x %d",
+                 imgSize.width(), imgSize.height());
+        return {};
+    }
+
+    int stride = 0;
+    const uint8_t* data = heif_image_get_plane_readonly(srcImage.get(), channel, &stride);
+
+    if (!data) {
+        qWarning("convertImage() pixel data not found");
+        return {};
+    }
+
+    if (stride <= 0) {
+        qWarning("convertImage() invalid stride: %d", stride);
+        return {};
+    }
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01040000
+    const int bits = heif_image_get_bits_per_pixel_range(srcImage.get(), channel);
+#else
+    const int bits = 8;
+#endif
+
+    // map image format
+    QImage::Format qtFormat = QImage::Format_Invalid;
+
+    switch (heifFormat) {
+    case heif_chroma_monochrome: {
+        qtFormat = QImage::Format_Grayscale8;
+        break;
+    }
+    case heif_chroma_interleaved_RGB: {
+        qtFormat = QImage::Format_RGB888;
+        break;
+    }
+    case heif_chroma_interleaved_RGBA: {
+        // RGBX is the same data, marked as opaque
+        qtFormat = format == QImage::Format_RGBX8888 ? QImage::Format_RGBX8888
+                                                     : QImage::Format_RGBA8888;
+        break;
+    }
+    default:
+        break;
+    }
+
+    auto allocDestImage = [&]() {
+        QImage image = allocImage(reuse, imgSize, format);
+        if (image.isNull()) {
+            qWarning("convertImage() failed to allocate image");
+        }
+        return image;
+    };
+
+    if (bits > 8) {
+        // samples are 16 bits in host byte order
+        const bool isGray = heifFormat == heif_chroma_monochrome;
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+        if (isGray && format == QImage::Format_Grayscale16) {
+            QImage destImage = allocDestImage();
+
+            for (int y = 0; y < destImage.height(); ++y) {
+                QHeifConvert::convertRowFromGray16(
+                    reinterpret_cast<const quint16*>(data + y * stride), bits,
+                    reinterpret_cast<quint16*>(destImage.scanLine(y)),
+                    imgSize.width());
+            }
+
+            return destImage;
+        }
+#endif
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+        if (!isGray && (format == QImage::Format_RGBX64
+                        || format == QImage::Format_RGBA64
+                        || format == QImage::Format_RGBA64_Premultiplied)) {
+            const bool hasAlpha = heifFormat == heif_chroma_interleaved_RRGGBBAA_LE
+                || heifFormat == heif_chroma_interleaved_RRGGBBAA_BE;
+
+            QImage destImage = allocDestImage();
+
+            for (int y = 0; y < destImage.height(); ++y) {
+                QHeifConvert::convertRowFromRgb16(
+                    format,
+                    reinterpret_cast<const quint16*>(data + y * stride), hasAlpha, bits,
+                    destImage.scanLine(y),
+                    imgSize.width());
+            }
+
+            return destImage;
+        }
+#endif
+
+        qWarning("convertImage() unexpected high bit depth image: %d bits", bits);
+        return {};
+    }
+
+    if (qtFormat == QImage::Format_Invalid) {
+        qWarning("convertImage() unsupported chroma format: %d", heifFormat);
+        return {};
+    }
+
+    if (qtFormat == QImage::Format_RGBA8888 && format != qtFormat
+        && QHeifConvert::canConvertFromRgba(format)) {
+        // convert straight out of the heif image
+        QImage destImage = allocDestImage();
+
+        for (int y = 0; y < destImage.height(); ++y) {
+            QHeifConvert::convertRowFromRgba(format,
+                                             data + y * stride,
+                                             destImage.scanLine(y),
+                                             imgSize.width());
+        }
+
+        return destImage;
+    }
+
+    // move data ownership to QImage; writable, so the buffer can be reused
+    heif_image* dataImage = srcImage.release();
+    uint8_t* writableData = heif_image_get_plane(dataImage, channel, &stride);
+
+    QImage image(
+        writableData, imgSize.width(), imgSize.height(),
+        stride, qtFormat,
+        [](void* img) { heif_image_release(static_cast<heif_image*>(img)); },
+        dataImage
+    );
+
+    if (qtFormat != format) {
+        image = image.convertToFormat(format);
+    }
+
+    return image;
+}
+
+/**
+ * Returns a pointer to pixel rect.left() of row y of a decoded image, in
+ * the read format. Rows are either read in place, or converted into the
+ * given buffer of rect.width() + 1 pixels.
+ */
+using RowReader = std::function<const uchar*(int y, uchar* buffer)>;
+
+/**
+ * Returns whether downscaleRows() can read the region rect of an image of
+ * the given size and format at outSize.
+ */
+bool canDownscaleTo(const QSize& size,
+                    const QRect& rect,
+                    const QSize& outSize,
+                    QImage::Format format)
+{
+    return QHeifConvert::canDownscale(format)
+        && QRect(QPoint(0, 0), size).contains(rect)
+        && !outSize.isEmpty()
+        && outSize != rect.size()
+        && outSize.width() <= rect.width()
+        && outSize.height() <= rect.height();
+}
+
+/**
+ * Reads the region rect of a decoded image at outSize, averaging boxes of
+ * pixels while rows are read. Each row is read once, and no image of the
+ * full region is created. Bands of rows are read in parallel. The buffer
+ * of *reuse is used if possible (see allocImage()).
+ */
+QImage downscaleRows(const QRect& rect,
+                     const QSize& outSize,
+                     QImage::Format format,
+                     int threads,
+                     const RowReader& readRow,
+                     QImage* reuse)
+{
+    QImage destImage = allocImage(reuse, outSize, format);
+    if (destImage.isNull()) {
+        qWarning("downscaleRows() failed to allocate image");
+        return {};
+    }
+
+    uchar* const destBits = destImage.bits();
+    const int destStride = destImage.bytesPerLine();
+
+    auto rowStart = [&](int destY) {
+        return rect.top()
+            + static_cast<int>(static_cast<qint64>(destY) * rect.height() / outSize.height());
+    };
+
+    const int bandHeight = 16;
+    const int numBands = (outSize.height() + bandHeight - 1) / bandHeight;
+
+    parallelFor(numBands, threads, [&](int band) {
+        std::vector<uchar> buffer(4 * (rect.width() + 1));
+        std::vector<quint64> sums(4 * outSize.width());
+
+        const int endY = qMin(outSize.height(), (band + 1) * bandHeight);
+
+        for (int destY = band * bandHeight; destY < endY; ++destY) {
+            std::fill(sums.begin(), sums.end(), 0);
+
+            const int firstRow = rowStart(destY);
+            const int lastRow = rowStart(destY + 1);
+
+            for (int y = firstRow; y < lastRow; ++y) {
+                QHeifConvert::sumRowBoxes(format, readRow(y, buffer.data()), rect.width(),
+                                          sums.data(), outSize.width());
+            }
+
+            QHeifConvert::averageBoxes(format, sums.data(), rect.width(), lastRow - firstRow,
+                                       destBits + destY * destStride, outSize.width());
+        }
+    });
+
+    return destImage;
+}
+
+/**
+ * Returns the region rect of an image, sharing data if it is the whole image.
+ */
+QImage clipImage(const QImage& image, const QRect& rect)
+{
+    if (image.isNull() || rect == image.rect()) {
+        return image;
+    }
+
+    return image.copy(rect);
+}
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x010a0000
+using NclxProfilePtr = std::unique_ptr<heif_color_profile_nclx,
+                                       decltype(&heif_nclx_color_profile_free)>;
+#endif
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01100000
+/**
+ * Finds the YCbCr matrix of an nclx profile. Images without a profile use
+ * libheif's default, which is full range BT.601.
+ */
+bool findNclxMatrix(heif_error error,
+                    heif_color_profile_nclx* nclxPtr,
+                    QHeifConvert::YCbCrMatrix* matrix)
+{
+    NclxProfilePtr nclx(nclxPtr, heif_nclx_color_profile_free);
+
+    if (error.code || !nclx) {
+        return QHeifConvert::findYCbCrMatrix(heif_matrix_coefficients_ITU_R_BT_601_6,
+                                             true, matrix);
+    }
+
+    return QHeifConvert::findYCbCrMatrix(nclx->matrix_coefficients,
+                                         nclx->full_range_flag,
+                                         matrix);
+}
+
+/**
+ * Returns the native chroma of an image if decodeYCbCr() can produce the
+ * given format from it, or heif_chroma_undefined otherwise.
+ */
+heif_chroma nativeYCbCrChroma(const heif_image_handle* handle, QImage::Format format)
+{
+    if (!QHeifConvert::canConvertFromYCbCr(format)
+        || heif_image_handle_has_alpha_channel(handle)
+        || heif_image_handle_get_luma_bits_per_pixel(handle) != 8
+        || heif_image_handle_get_chroma_bits_per_pixel(handle) != 8) {
+        return heif_chroma_undefined;
+    }
+
+    heif_colorspace colorspace = heif_colorspace_undefined;
+    heif_chroma chroma = heif_chroma_undefined;
+    auto error = heif_image_handle_get_preferred_decoding_colorspace(handle,
+                                                                     &colorspace,
+                                                                     &chroma);
+
+    if (error.code || colorspace != heif_colorspace_YCbCr
+        || (chroma != heif_chroma_420 && chroma != heif_chroma_422
+            && chroma != heif_chroma_444)) {
+        return heif_chroma_undefined;
+    }
+
+    // check the container's profile; the decoded image is checked again
+    heif_color_profile_nclx* nclx = nullptr;
+    error = heif_image_handle_get_nclx_color_profile(handle, &nclx);
+
+    QHeifConvert::YCbCrMatrix matrix;
+    if (!findNclxMatrix(error, nclx, &matrix)) {
+        return heif_chroma_undefined;
+    }
+
+    return chroma;
+}
+
+/**
+ * Decodes an image in its native YCbCr chroma, and converts the region rect
+ * straight into a QImage of the given format. This replaces libheif's
+ * conversion to RGB and its intermediate image. The region is downscaled
+ * to outSize during conversion, if possible. The buffer of *reuse is used
+ * if possible (see allocImage()).
+ *
+ * Returns false if the decoded image uses a matrix that can't be converted,
+ * in which case the image must be decoded by libheif as RGB instead.
+ */
+bool decodeYCbCr(const heif_image_handle* handle,
+                 heif_chroma chroma,
+                 QImage::Format format,
+                 const QRect& rect,
+                 const QSize& outSize,
+                 const DecodeSettings& settings,
+                 QImage* reuse,
+                 QImage* image)
+{
+    heif_image* srcImagePtr = nullptr;
+    auto error = heif_decode_image(handle,
+                                   &srcImagePtr,
+                                   heif_colorspace_YCbCr,
+                                   chroma,
+                                   decodingOptions(settings).get());
+
+    auto srcImage = wrapPointer(srcImagePtr, heif_image_release);
+    if (error.code || !srcImage) {
+        qDebug("decodeYCbCr() failed to decode image: %s", error.message);
+        *image = {};
+        return true;
+    }
+
+    heif_color_profile_nclx* nclx = nullptr;
+    error = heif_image_get_nclx_color_profile(srcImage.get(), &nclx);
+
+    QHeifConvert::YCbCrMatrix matrix;
+    if (!findNclxMatrix(error, nclx, &matrix)) {
+        qDebug("decodeYCbCr() unsupported matrix; using libheif conversion");
+        return false;
+    }
+
+    int strideY = 0;
+    int strideCb = 0;
+    int strideCr = 0;
+    const uint8_t* dataY = heif_image_get_plane_readonly(srcImage.get(),
+                                                         heif_channel_Y,
+                                                         &strideY);
+    const uint8_t* dataCb = heif_image_get_plane_readonly(srcImage.get(),
+                                                          heif_channel_Cb,
+                                                          &strideCb);
+    const uint8_t* dataCr = heif_image_get_plane_readonly(srcImage.get(),
+                                                          heif_channel_Cr,
+                                                          &strideCr);
+
+    if (!dataY || !dataCb || !dataCr) {
+        qWarning("decodeYCbCr() pixel data not found");
+        *image = {};
+        return true;
+    }
+
+    const QSize size(heif_image_get_width(srcImage.get(), heif_channel_Y),
+                     heif_image_get_height(srcImage.get(), heif_channel_Y));
+
+    const int shiftX = chroma == heif_chroma_444 ? 0 : 1;
+    const int shiftY = chroma == heif_chroma_420 ? 1 : 0;
+
+    if (canDownscaleTo(size, rect, outSize, format)) {
+        // start conversion at a chroma sample boundary
+        const int firstX = rect.left() >> shiftX << shiftX;
+        const int offset = 4 * (rect.left() - firstX);
+        const int width = rect.right() + 1 - firstX;
+
+        *image = downscaleRows(rect, outSize, format, settings.threads,
+                               [&](int y, uchar* buffer) {
+            const int chromaY = y >> shiftY;
+            QHeifConvert::convertRowFromYCbCr(format,
+                                              matrix,
+                                              dataY + y * strideY + firstX,
+                                              dataCb + chromaY * strideCb + (firstX >> shiftX),
+                                              dataCr + chromaY * strideCr + (firstX >> shiftX),
+                                              shiftX,
+                                              buffer,
+                                              width);
+            return static_cast<const uchar*>(buffer + offset);
+        }, reuse);
+
+        return true;
+    }
+
+    // clipped or scaled images are copied out of the full one
+    const bool isFinal = rect == QRect(QPoint(0, 0), size) && outSize == size;
+
+    QImage destImage = allocImage(isFinal ? reuse : nullptr, size, format);
+    if (destImage.isNull()) {
+        qWarning("decodeYCbCr() failed to allocate image");
+        *image = {};
+        return true;
+    }
+
+    uchar* const destBits = destImage.bits();
+    const int destStride = destImage.bytesPerLine();
+
+    // convert in bands of rows, in parallel
+    const int bandHeight = 64;
+    const int numBands = (size.height() + bandHeight - 1) / bandHeight;
+
+    parallelFor(numBands, settings.threads, [&](int band) {
+        const int endY = qMin(size.height(), (band + 1) * bandHeight);
+
+        for (int y = band * bandHeight; y < endY; ++y) {
+            const int chromaY = y >> shiftY;
+            QHeifConvert::convertRowFromYCbCr(format,
+                                              matrix,
+                                              dataY + y * strideY,
+                                              dataCb + chromaY * strideCb,
+                                              dataCr + chromaY * strideCr,
+                                              shiftX,
+                                              destBits + y * destStride,
+                                              size.width());
+        }
+    });
+
+    *image = clipImage(destImage, rect);
+    return true;
+}
+#endif
+
+/**
+ * Decodes the region rect of an image. The region is downscaled to outSize
+ * while converting, if possible; otherwise, it is returned at full size.
+ * The buffer of *reuse is used if possible (see allocImage()).
+ */
+QImage decodeImage(const heif_image_handle* handle,
+                   const QRect& rect,
+                   const QSize& outSize,
+                   const DecodeSettings& settings,
+                   QImage* reuse)
+{
+    const auto format = readFormat(handle, settings);
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01100000
+    const heif_chroma nativeChroma = nativeYCbCrChroma(handle, format);
+
+    if (nativeChroma != heif_chroma_undefined) {
+        QImage image;
+        if (decodeYCbCr(handle, nativeChroma, format, rect, outSize, settings, reuse,
+                        &image)) {
+            return image;
+        }
+    }
+#endif
+
+    const auto target = decodeFormat(format);
+
+    heif_image* srcImagePtr = nullptr;
+    auto error = heif_decode_image(handle,
+                                   &srcImagePtr,
+                                   target.colorspace,
+                                   target.chroma,
+                                   decodingOptions(settings).get());
+
+    auto srcImage = wrapPointer(srcImagePtr, heif_image_release);
+    if (error.code || !srcImage) {
+        qDebug("decodeImage() failed to decode image: %s", error.message);
+        return {};
+    }
+
+    // monochrome images have no interleaved channel
+    const auto channel = heif_image_get_chroma_format(srcImage.get()) == heif_chroma_monochrome
+        ? heif_channel_Y
+        : heif_channel_interleaved;
+
+    const QSize size(heif_image_get_width(srcImage.get(), channel),
+                     heif_image_get_height(srcImage.get(), channel));
+
+    int stride = 0;
+    const uint8_t* data = heif_image_get_plane_readonly(srcImage.get(),
+                                                        heif_channel_interleaved,
+                                                        &stride);
+
+    if (data && heif_image_get_chroma_format(srcImage.get()) == heif_chroma_interleaved_RGBA
+        && QHeifConvert::canConvertFromRgba(format)
+        && canDownscaleTo(size, rect, outSize, format)) {
+        // RGBA8888 and RGBX8888 hold the decoded data as is
+        const bool inPlace = format == QImage::Format_RGBA8888
+            || format == QImage::Format_RGBX8888;
+
+        return downscaleRows(rect, outSize, format, settings.threads,
+                             [&](int y, uchar* buffer) {
+            const uchar* src = data + y * stride + 4 * rect.left();
+
+            if (inPlace) {
+                return src;
+            }
+
+            QHeifConvert::convertRowFromRgba(format, src, buffer, rect.width());
+            return static_cast<const uchar*>(buffer);
+        }, reuse);
+    }
+
+    const bool isFinal = rect == QRect(QPoint(0, 0), size) && outSize == size;
+    return clipImage(convertImage(std::move(srcImage), format, isFinal ? reuse : nullptr),
+                     rect);
+}
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01130000
+/**
+ * Decodes only the tiles of a tiled (e.g. grid) image that intersect rect.
+ * Tiles are decoded in parallel. Returns a null image if the image is not
+ * tiled or decoding fails.
+ *
+ * Tiles are decoded straight into the result, and may fail after others
+ * were written, so the buffer of the image read into is never reused.
+ */
+QImage decodeTiles(const heif_image_handle* handle,
+                   const QRect& rect,
+                   const DecodeSettings& settings)
+{
+    heif_image_tiling tiling{};
+    auto error = heif_image_handle_get_image_tiling(handle,
+                                                    !settings.ignoreTransformations,
+                                                    &tiling);
+
+    if (error.code || tiling.tile_width == 0 || tiling.tile_height == 0
+        || tiling.num_columns * tiling.num_rows <= 1) {
+        return {};
+    }
+
+    const int tileWidth = static_cast<int>(tiling.tile_width);
+    const int tileHeight = static_cast<int>(tiling.tile_height);
+
+    const int firstColumn = rect.left() / tileWidth;
+    const int firstRow = rect.top() / tileHeight;
+    const int lastColumn = qMin(rect.right() / tileWidth,
+                                static_cast<int>(tiling.num_columns) - 1);
+    const int lastRow = qMin(rect.bottom() / tileHeight,
+                             static_cast<int>(tiling.num_rows) - 1);
+
+    const int numColumns = lastColumn - firstColumn + 1;
+    const int numTiles = numColumns * (lastRow - firstRow + 1);
+
+    const auto format = readFormat(handle, settings);
+    const auto target = decodeFormat(format);
+
+    QImage destImage(rect.size(), format);
+    if (destImage.isNull()) {
+        qWarning("decodeTiles() failed to allocate image");
+        return {};
+    }
+
+    uchar* const destBits = destImage.bits();
+    const int destStride = destImage.bytesPerLine();
+
+    const auto options = decodingOptions(settings);
+    std::atomic<bool> failed{false};
+
+    // tiles cover disjoint parts of destImage, so they can be written concurrently
+    parallelFor(numTiles, settings.threads, [&](int tileIndex) {
+        if (failed) {
+            return;
+        }
+
+        const int column = firstColumn + tileIndex % numColumns;
+        const int row = firstRow + tileIndex / numColumns;
+
+        heif_image* tilePtr = nullptr;
+        auto tileError = heif_image_handle_decode_image_tile(handle,
+                                                             &tilePtr,
+                                                             target.colorspace,
+                                                             target.chroma,
+                                                             options.get(),
+                                                             column, row);
+
+        auto tile = wrapPointer(tilePtr, heif_image_release);
+        if (tileError.code || !tile) {
+            qDebug("decodeTiles() failed to decode tile: %s", tileError.message);
+            failed = true;
+            return;
+        }
+
+        const QImage tileImage = convertImage(std::move(tile), destImage.format(), nullptr);
+        if (tileImage.isNull()) {
+            failed = true;
+            return;
+        }
+
+        // copy the part of the tile inside rect
+        const QRect tileRect(QPoint(column * tileWidth, row * tileHeight),
+                             tileImage.size());
+        const QRect part = tileRect.intersected(rect);
+        const int bytesPerPixel = tileImage.depth() / 8;
+        const int lineSize = part.width() * bytesPerPixel;
+
+        for (int y = part.top(); y <= part.bottom(); ++y) {
+            const uchar* src = tileImage.constScanLine(y - tileRect.top())
+                + (part.left() - tileRect.left()) * bytesPerPixel;
+            uchar* dest = destBits + (y - rect.top()) * destStride
+                + (part.left() - rect.left()) * bytesPerPixel;
+            std::copy(src, src + lineSize, dest);
+        }
+    });
+
+    if (failed) {
+        return {};
+    }
+
+    return destImage;
+}
+#endif  // LIBHEIF_NUMERIC_VERSION >= 0x01130000
+
+/**
+ * Decodes the given region of an image. Only tiles intersecting the region
+ * are decoded, if the image is tiled and libheif supports it. The region is
+ * returned at outSize if it could be downscaled while decoding, and at full
+ * size otherwise. The buffer of *reuse is used if possible (see
+ * allocImage()), except for tiles.
+ */
+QImage decodeRegion(const heif_image_handle* handle,
+                    const QRect& rect,
+                    const QSize& outSize,
+                    const DecodeSettings& settings,
+                    QImage* reuse)
+{
+    const QRect handleRect(QPoint(0, 0), decodedSize(handle, settings));
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01130000
+    if (rect != handleRect) {
+        QImage tiledImage = decodeTiles(handle, rect, settings);
+
+        if (!tiledImage.isNull()) {
+            return tiledImage;
+        }
+    }
+#endif
+
+    return decodeImage(handle, rect, outSize, settings, reuse);
+}
+
+/**
+ * Everything needed to read one image. Independent of handler state, so
+ * it can be decoded on another thread.
+ */
+struct ReadRequest
+{
+    std::shared_ptr<heif_context> context;
+    heif_item_id id;
+    QRect clipRect;    // null if not clipped
+    QSize scaledSize;  // invalid if not scaled
+    DecodeSettings settings;
+};
+
+bool isSameImage(const ReadRequest& a, const ReadRequest& b)
+{
+    return a.context == b.context
+        && a.id == b.id
+        && a.clipRect == b.clipRect
+        && a.scaledSize == b.scaledSize
+        && a.settings.premultiplied == b.settings.premultiplied;
+}
+
+/**
+ * Decodes the requested image, applying clip rect and scaled size.
+ * Returns a null image on failure. The buffer of *reuse is used if
+ * possible (see allocImage()); reuse may be null.
+ */
+QImage decodeRequest(const ReadRequest& request, QImage* reuse)
+{
+    // get image handle
+    auto handle = getImageHandle(request.context.get(), request.id);
+    if (!handle) {
+        qDebug("decodeRequest() failed to get image handle");
+        return {};
+    }
+
+    // leave rotation and mirroring to Qt, if possible
+    DecodeSettings settings = request.settings;
+    settings.ignoreTransformations = findTransformation(request.context.get(),
+                                                        request.id,
+                                                        &settings.transformation);
+
+    // determine region to read
+    const QSize imageSize = decodedSize(handle.get(), settings);
+    QRect clipRect(QPoint(0, 0), imageSize);
+
+    if (!request.clipRect.isNull()) {
+        clipRect = clipRect.intersected(request.clipRect);
+
+        if (clipRect.isEmpty()) {
+            qWarning("decodeRequest() clip rect outside of image");
+            return {};
+        }
+    }
+
+    const QSize& scaledSize = request.scaledSize;
+    const QSize outSize = scaledSize.isValid() ? scaledSize : clipRect.size();
+
+    // decode a thumbnail instead, if one is big enough for the requested size
+    if (scaledSize.isValid()) {
+        // clipped part of thumbnail must be at least the requested size
+        const QSize minThumbSize = mapRect(QRect(QPoint(0, 0), scaledSize),
+                                           clipRect.size(), imageSize).size();
+
+        auto thumb = findThumbnail(request.context.get(), handle.get(),
+                                   minThumbSize, settings);
+
+        if (thumb) {
+            const QSize thumbSize = decodedSize(thumb.get(), settings);
+
+            clipRect = mapRect(clipRect, imageSize, thumbSize);
+            handle = std::move(thumb);
+        }
+    }
+
+    // decode image
+    QImage image = decodeRegion(handle.get(), clipRect, outSize, settings, reuse);
+    if (image.isNull()) {
+        qDebug("decodeRequest() failed to decode image");
+        return {};
+    }
+
+    if (image.size() != outSize) {
+        image = image.scaled(outSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+
+    return image;
+}
+
+/**
+ * Returns the format of frames read from a track.
+ */
+QImage::Format frameFormat(bool hasAlpha, bool premultiplied)
+{
+    if (premultiplied) {
+        return hasAlpha ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32;
+    } else {
+        return hasAlpha ? QImage::Format_RGBA8888 : QImage::Format_RGBX8888;
+    }
+}
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01140000
+/**
+ * Decodes the next frame of a track, for reading in the given format.
+ * Returns null at the end of the track, or on failure.
+ */
+ImagePtr decodeFrame(heif_track* track,
+                     QImage::Format format,
+                     const DecodeSettings& settings,
+                     quint32* duration)
+{
+    const auto target = decodeFormat(format);
+
+    heif_image* framePtr = nullptr;
+    auto error = heif_track_decode_next_image(track,
+                                              &framePtr,
+                                              target.colorspace,
+                                              target.chroma,
+                                              decodingOptions(settings).get());
+
+    auto frame = wrapPointer(framePtr, heif_image_release);
+
+    if (error.code == heif_error_End_of_sequence) {
+        frame.reset();
+        return frame;
+    }
+
+    if (error.code || !frame) {
+        qDebug("decodeFrame() failed to decode frame: %s", error.message);
+        frame.reset();
+        return frame;
+    }
+
+    *duration = heif_image_get_duration(frame.get());
+    return frame;
+}
+#endif  // LIBHEIF_NUMERIC_VERSION >= 0x01140000
+
+}  // namespace
+
+/**
+ * Decodes an image ahead of time on a pool thread.
+ */
+struct QHeifHandler::DecodeJob : BackgroundJob
+{
+    DecodeJob(int imageIndex, ReadRequest&& readRequest);
+
+    void run() override;
+
+    const int index;
+    const ReadRequest request;
+
+    QImage image;  // valid once state is Done
+};
+
+QHeifHandler::DecodeJob::DecodeJob(int imageIndex, ReadRequest&& readRequest) :
+    index(imageIndex),
+    request(std::move(readRequest)),
+    image()
+{
+}
+
+void QHeifHandler::DecodeJob::run()
+{
+    image = decodeRequest(request, nullptr);
+}
+
+QHeifHandler::ReadState::~ReadState()
+{
+    // jobs use context data owned by this state
+    for (auto& job : decodeJobs) {
+        job->cancel();
+        job->wait();
+    }
+}
+
+/**
+ * Decodes the next frame of a sequence ahead of time on a pool thread.
+ * Frames are queued in decoding order, regardless of which job decoded
+ * them.
+ */
+struct QHeifHandler::FrameJob : BackgroundJob
+{
+    explicit FrameJob(SequenceState* seq) :
+        sequence(seq)
+    {
+    }
+
+    void run() override
+    {
+        sequence->decodeNext();
+    }
+
+    SequenceState* const sequence;  // waits for the job before it is destroyed
+};
+
+QHeifHandler::SequenceState::~SequenceState()
+{
+    // jobs use the track
+    for (auto& job : jobs) {
+        job->cancel();
+        job->wait();
+    }
+}
+
+bool QHeifHandler::SequenceState::decodeNext()
+{
+    QMutexLocker decodeLocker(&decodeMutex);
+
+    if (ended) {
+        return false;
+    }
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01140000
+    DecodeSettings settings{};
+    settings.hdrTo8Bit = hdrTo8Bit;
+    settings.decoderId = decoderId;
+
+    // all frame formats are decoded from RGBA
+    quint32 duration = 0;
+    FramePtr image = decodeFrame(track.get(), frameFormat(hasAlpha, false), settings,
+                                 &duration);
+
+    if (image) {
+        const int delay = timescale > 0
+            ? static_cast<int>(static_cast<qint64>(duration) * 1000 / timescale)
+            : 0;
+
+        QMutexLocker locker(&mutex);
+        frames.push_back({std::move(image), delay});
+        return true;
+    }
+#endif
+
+    ended = true;
+    return false;
+}
+
+bool QHeifHandler::SequenceState::takeDecoded()
+{
+    QMutexLocker locker(&mutex);
+
+    if (frames.empty()) {
+        return false;
+    }
+
+    nextFrame = std::move(frames.front().image);
+    nextFrameDelay = frames.front().delay;
+    frames.pop_front();
+    return true;
+}
+
+int QHeifHandler::SequenceState::numDecoded()
+{
+    if (ended) {
+        return -1;
+    }
+
+    QMutexLocker locker(&mutex);
+    return static_cast<int>(frames.size());
+}
+
+std::unique_ptr<QHeifHandler::SequenceState> QHeifHandler::openSequence(
+    heif_context* context) const
+{
+    std::unique_ptr<SequenceState> sequence;
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01140000
+    if (!heif_context_has_sequence(context)) {
+        return sequence;
+    }
+
+    // first visual track
+    sequence.reset(new SequenceState);
+    sequence->track.reset(heif_context_get_track(context, 0));
+
+    if (!sequence->track) {
+        qDebug("QHeifHandler::openSequence() failed to get track");
+        sequence.reset();
+        return sequence;
+    }
+
+    const heif_track* track = sequence->track.get();
+    sequence->timescale = heif_track_get_timescale(track);
+    sequence->hasAlpha = heif_track_has_alpha_channel(track);
+
+    uint16_t width = 0;
+    uint16_t height = 0;
+    if (!heif_track_get_image_resolution(track, &width, &height).code) {
+        sequence->size = QSize(width, height);
+    }
+
+    sequence->hdrTo8Bit = _hdrTo8Bit;
+    sequence->decoderId = selectedDecoderId();
+#else
+    Q_UNUSED(context);
+#endif
+
+    return sequence;
+}
+
+bool QHeifHandler::ensureContext() const
+{
+    // loading the context only caches what the device already contains
+    const_cast<QHeifHandler*>(this)->loadContext();
+    return static_cast<bool>(_readState);
+}
+
+namespace {
+
+ReadRequest makeReadRequest(const std::shared_ptr<heif_context>& context,
+                            heif_item_id id,
+                            const QRect& clipRect,
+                            const QSize& scaledSize,
+                            int decodeThreads,
+                            bool singleThreaded,
+                            bool premultiplied,
+                            bool hdrTo8Bit)
+{
+    ReadRequest request{};
+    request.context = context;
+    request.id = id;
+    request.clipRect = clipRect;
+    request.scaledSize = scaledSize;
+    request.settings.threads = decodeThreads > 0 ? decodeThreads
+                                                 : QThread::idealThreadCount();
+
+    if (singleThreaded) {
+        request.settings.threads = 1;
+    }
+
+    request.settings.premultiplied = premultiplied;
+    request.settings.hdrTo8Bit = hdrTo8Bit;
+    request.settings.decoderId = selectedDecoderId();
+
+    return request;
+}
+
+}  // namespace
+
+bool QHeifHandler::read(QImage* destImage)
+{
+    if (!destImage) {
+        qWarning("QHeifHandler::read() QImage to read into is null");
+        return false;
+    }
+
+    loadContext();
+
+    if (!_readState) {
+        qWarning("QHeifHandler::read() failed to create context");
+        return false;
+    }
+
+    if (_readState->sequence) {
+        return readFrame(destImage);
+    }
+
+    int idIndex = _readState->currentIndex;
+    Q_ASSERT(idIndex >= 0 && static_cast<size_t>(idIndex) < _readState->idList.size());
+
+    // honor paint-ready format of image passed in
+    const auto destFormat = destImage->format();
+    const bool premultiplied = _premultiplied
+        || destFormat == QImage::Format_ARGB32_Premultiplied
+        || destFormat == QImage::Format_RGB32;
+
+    // device reads are not atomic (seek, then read), so keep them on one thread
+    auto request = makeReadRequest(_readState->context,
+                                   _readState->idList[idIndex],
+                                   _clipRect,
+                                   _scaledSize,
+                                   _decodeThreads,
+                                   static_cast<bool>(_readState->deviceReader),
+                                   premultiplied,
+                                   _hdrTo8Bit);
+
+    // use image decoded ahead, if any
+    QImage image;
+    bool decoded = false;
+    auto& jobs = _readState->decodeJobs;
+
+    for (auto iter = jobs.begin(); iter != jobs.end(); ++iter) {
+        auto& job = *iter;
+
+        if (job->index == idIndex && isSameImage(job->request, request)) {
+            job->tryRun();
+            job->wait();
+
+            if (job->state == DecodeJob::Done) {
+                image = job->image;
+                decoded = true;
+            }
+
+            jobs.erase(iter);
+            break;
+        }
+    }
+
+    if (!decoded) {
+        // decode into the image passed in, if it can be reused
+        image = decodeRequest(request, destImage);
+    }
+
+    if (image.isNull()) {
+        qDebug("QHeifHandler::read() failed to decode image");
+        return false;
+    }
+
+    *destImage = image;
+    _readState->imageRead = true;
+
+    updateDecodeAhead(idIndex + 1, premultiplied);
+
+    if (idIndex == _readState->numReadInOrder) {
+        ++_readState->numReadInOrder;
+    }
+
+    // images read out of order may still be jumped back to
+    if (_lowMemory
+        && static_cast<size_t>(_readState->numReadInOrder) == _readState->idList.size()) {
+        // no further images to read
+        releaseReadState();
+    }
+
+    return true;
+}
+
+bool QHeifHandler::fetchFrame()
+{
+    Q_ASSERT(_readState && _readState->sequence);
+
+    auto& sequence = *_readState->sequence;
+    auto& jobs = sequence.jobs;
+
+    if (sequence.nextFrame) {
+        return true;
+    }
+
+    // take the oldest frame decoded ahead, running or waiting for jobs
+    // until one is queued; decode in this thread if there are none
+    while (!sequence.takeDecoded()) {
+        if (!jobs.empty()) {
+            auto job = jobs.front();
+            jobs.erase(jobs.begin());
+
+            job->tryRun();
+            job->wait();
+        } else if (!sequence.decodeNext()) {
+            break;
+        }
+    }
+
+    if (!sequence.nextFrame) {
+        if (_lowMemory) {
+            // no further frames to read
+            releaseReadState();
+        }
+
+        return false;
+    }
+
+    // libheif reads from the device during decoding, which is not thread-safe
+    if (_decodeAhead > 0 && !_readState->deviceReader) {
+        jobs.erase(std::remove_if(jobs.begin(), jobs.end(),
+                                  [](const std::shared_ptr<FrameJob>& job) {
+                                      return job->state == FrameJob::Done;
+                                  }),
+                   jobs.end());
+
+        // frames decoded or being decoded; none are started after the end
+        const int numDecoded = sequence.numDecoded();
+        int numAhead = numDecoded + static_cast<int>(jobs.size());
+
+        while (numDecoded >= 0 && numAhead < _decodeAhead) {
+            std::shared_ptr<FrameJob> job(new FrameJob(&sequence));
+            jobs.push_back(job);
+            ++numAhead;
+
+            QThreadPool::globalInstance()->start(new FunctionRunnable([job]() {
+                job->tryRun();
+            }));
+        }
+    }
+
+    return true;
+}
+
+bool QHeifHandler::readFrame(QImage* destImage)
+{
+    if (!fetchFrame()) {
+        qDebug("QHeifHandler::readFrame() no frames left");
+        return false;
+    }
+
+    auto& sequence = *_readState->sequence;
+
+    // honor paint-ready format of image passed in
+    const auto destFormat = destImage->format();
+    const bool premultiplied = _premultiplied
+        || destFormat == QImage::Format_ARGB32_Premultiplied
+        || destFormat == QImage::Format_RGB32;
+
+    // convert into the image passed in, if it can be reused
+    const bool fullFrame = _clipRect.isNull() && !_scaledSize.isValid();
+    QImage frame = convertImage(std::move(sequence.nextFrame),
+                                frameFormat(sequence.hasAlpha, premultiplied),
+                                fullFrame ? destImage : nullptr);
+
+    sequence.nextFrame.reset();
+    sequence.frameDelay = sequence.nextFrameDelay;
+    ++sequence.frameIndex;
+
+    if (!_clipRect.isNull()) {
+        frame = clipImage(frame, frame.rect().intersected(_clipRect));
+    }
+
+    if (_scaledSize.isValid() && frame.size() != _scaledSize) {
+        frame = frame.scaled(_scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+
+    if (frame.isNull()) {
+        qDebug("QHeifHandler::readFrame() failed to convert frame");
+        return false;
+    }
+
+    *destImage = frame;
+    return true;
+}
+
+heif_compression_format QHeifHandler::currentCompression() const
+{
+    Q_ASSERT(_readState);
+
+    if (_readState->sequence) {
+        return brandCompression(_readState->fileFormat);
+    }
+
+    return itemCompression(_readState->context.get(),
+                           _readState->idList[_readState->currentIndex],
+                           _readState->fileFormat);
+}
+
+void QHeifHandler::releaseReadState()
+{
+    Q_ASSERT(_readState);
+
+    // only data owned by this state is freed; cached contexts stay alive,
+    // and lazily read devices hold no file data, saving 0 bytes
+    qint64 savedBytes = _readState->fileData.size();
+
+    if (_readState->mappedFile) {
+        savedBytes += _readState->mappedFile->size();
+    }
+
+    std::weak_ptr<heif_context> context = _readState->context;
+
+    _releasedTransformation = 0;
+    _releasedCompression = currentCompression();
+
+    if (_readState->sequence) {
+        _releasedImageCount = 0;
+        _releasedImageIndex = _readState->sequence->frameIndex - 1;
+        _releasedFrameDelay = _readState->sequence->frameDelay;
+    } else {
+        _releasedImageCount = static_cast<int>(_readState->idList.size());
+        _releasedImageIndex = _readState->currentIndex;
+        findTransformation(_readState->context.get(),
+                           _readState->idList[_readState->currentIndex],
+                           &_releasedTransformation);
+    }
+
+    _readReleased = true;
+
+    _readState.reset();
+
+    qDebug("QHeifHandler::releaseReadState() released %lld bytes of file data;"
+           " context %s",
+           static_cast<long long>(savedBytes),
+           context.expired() ? "freed" : "still cached");
+}
+
+void QHeifHandler::updateDecodeAhead(int firstIndex, bool premultiplied)
+{
+    Q_ASSERT(_readState);
+
+    auto& jobs = _readState->decodeJobs;
+    const int numImages = static_cast<int>(_readState->idList.size());
+    const int lastIndex = qMin(firstIndex + _decodeAhead, numImages) - 1;
+
+    // libheif reads from the device during decoding, which is not thread-safe
+    const bool enabled = _decodeAhead > 0 && !_readState->deviceReader;
+
+    auto makeRequest = [&](int index) {
+        return makeReadRequest(_readState->context,
+                               _readState->idList[index],
+                               _clipRect,
+                               _scaledSize,
+                               _decodeThreads,
+                               false,
+                               premultiplied,
+                               _hdrTo8Bit);
+    };
+
+    // drop jobs outside of window, or for outdated read settings
+    auto isObsolete = [&](const std::shared_ptr<DecodeJob>& job) {
+        bool obsolete = !enabled
+            || job->index < firstIndex
+            || job->index > lastIndex
+            || !isSameImage(job->request, makeRequest(job->index));
+
+        if (obsolete) {
+            job->cancel();
+        }
+
+        // running jobs are kept until done; they still use the context
+        return obsolete && job->state != DecodeJob::Running;
+    };
+
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), isObsolete), jobs.end());
+
+    if (!enabled) {
+        return;
+    }
+
+    // start jobs for images not yet being decoded
+    for (int index = firstIndex; index <= lastIndex; ++index) {
+        auto hasJob = std::any_of(jobs.begin(), jobs.end(),
+                                  [&](const std::shared_ptr<DecodeJob>& job) {
+                                      return job->index == index
+                                          && job->state != DecodeJob::Canceled;
+                                  });
+
+        if (hasJob) {
+            continue;
+        }
+
+        std::shared_ptr<DecodeJob> job(new DecodeJob(index, makeRequest(index)));
+        jobs.push_back(job);
+
+        QThreadPool::globalInstance()->start(new FunctionRunnable([job]() {
+            job->tryRun();
+        }));
+    }
+}
+
+
+int QHeifHandler::currentImageNumber() const
+{
+    if (_readReleased && _device == device()) {
+        return _releasedImageIndex;
+    }
+
+    if (!_readState) {
+        return -1;
+    }
+
+    if (_readState->sequence) {
+        // frame last read or skipped, like other animation handlers
+        return _readState->sequence->frameIndex - 1;
+    }
+
+    return _readState->currentIndex;
+}
+
+int QHeifHandler::imageCount() const
+{
+    if (_readReleased && _device == device()) {
+        return _releasedImageCount;
+    }
+
+    if (!ensureContext()) {
+        return 0;
+    }
+
+    if (_readState->sequence) {
+        // unknown until all frames are decoded
+        return 0;
+    }
+
+    return static_cast<int>(_readState->idList.size());
+}
+
+int QHeifHandler::nextImageDelay() const
+{
+    if (_readReleased && _device == device()) {
+        return _releasedFrameDelay;
+    }
+
+    if (!_readState || !_readState->sequence) {
+        return 0;
+    }
+
+    return _readState->sequence->frameDelay;
+}
+
+int QHeifHandler::loopCount() const
+{
+    // libheif doesn't report edit list repetition, so sequences play once
+    return 0;
+}
+
+bool QHeifHandler::jumpToImage(int index)
+{
+    loadContext();
+
+    if (!_readState) {
+        return false;
+    }
+
+    if (_readState->sequence) {
+        // frames are decoded in order; skip frames up to index
+        auto& sequence = *_readState->sequence;
+
+        if (index < sequence.frameIndex) {
+            return false;
+        }
+
+        while (sequence.frameIndex < index) {
+            if (!fetchFrame()) {
+                return false;
+            }
+
+            sequence.nextFrame.reset();
+            ++sequence.frameIndex;
+        }
+
+        // frame at index must exist
+        return fetchFrame();
+    }
+
+    if (index < 0 || static_cast<size_t>(index) >= _readState->idList.size()) {
+        return false;
+    }
+
+    _readState->currentIndex = index;
+    _readState->imageRead = false;
+    updateDecodeAhead(index, _premultiplied);
+    return true;
+}
+
+bool QHeifHandler::jumpToNextImage()
+{
+    loadContext();
+
+    if (!_readState) {
+        return false;
+    }
+
+    if (_readState->sequence) {
+        // the frame after the last one read is read next anyway
+        return jumpToImage(_readState->sequence->frameIndex);
+    }
+
+    return jumpToImage(currentImageNumber() + 1);
+}
+
+namespace {
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01020000
+constexpr auto kWriteErrorCode = heif_error_Encoding_error;
+constexpr auto kWriteSubErrorCode = heif_suberror_Cannot_write_output_data;
+#else
+constexpr auto kWriteErrorCode = heif_error_Usage_error;
+constexpr auto kWriteSubErrorCode = heif_suberror_Unsupported_parameter;
+#endif
+
+heif_error handleWrite(heif_context* ctx, const void* data, size_t size, void* device)
+{
+    Q_UNUSED(ctx);
+    Q_ASSERT(data && device);
+
+    using I = typename std::conditional<sizeof(size_t) >= sizeof(qint64),
+                                        size_t,
+                                        qint64>::type;
+
+    if (static_cast<I>(size) > static_cast<I>(std::numeric_limits<qint64>::max())) {
+        return {kWriteErrorCode, kWriteSubErrorCode, "size too big"};
+    }
+
+    qint64 bytesWritten = static_cast<QIODevice*>(device)->write(
+        static_cast<const char*>(data), static_cast<qint64>(size));
+
+    if (bytesWritten != static_cast<qint64>(size)) {
+        return {kWriteErrorCode, kWriteSubErrorCode, "not all data written"};
+    }
+
+    return {heif_error_Ok, heif_suberror_Unspecified, "ok"};
+}
+
+using EncoderPtr = std::unique_ptr<heif_encoder, decltype(&heif_encoder_release)>;
+
+/**
+ * Settings that apply to encoding.
+ */
+struct EncodeSettings
+{
+    int quality;
+    heif_chroma chroma;
+    QByteArray preset;  // empty for the encoder's default
+    bool lossless;
+    int threads;  // 0 for the encoder's default
+};
+
+const char* chromaName(heif_chroma chroma)
+{
+    switch (chroma) {
+    case heif_chroma_422:
+        return "422";
+    case heif_chroma_444:
+        return "444";
+    default:
+        return "420";
+    }
+}
+
+/**
+ * Gets an HEVC encoder configured with the given settings. Parameters the
+ * encoder doesn't know are skipped with a warning.
+ */
+EncoderPtr getEncoder(const EncodeSettings& settings)
+{
+    heif_encoder* encoderPtr = nullptr;
+    auto error = heif_context_get_encoder_for_format(nullptr, heif_compression_HEVC,
+                                                     &encoderPtr);
+
+    auto encoder = wrapPointer(encoderPtr, heif_encoder_release);
+    if (error.code || !encoder) {
+        qWarning("getEncoder() failed to get encoder: %s", error.message);
+        return {nullptr, heif_encoder_release};
+    }
+
+    if (settings.lossless) {
+        error = heif_encoder_set_lossless(encoder.get(), 1);
+    } else {
+        error = heif_encoder_set_lossy_quality(encoder.get(), settings.quality);
+    }
+
+    if (error.code) {
+        qWarning("getEncoder() failed to set quality: %s", error.message);
+        return {nullptr, heif_encoder_release};
+    }
+
+    auto setParameter = [&](const char* name, const char* value) {
+        auto paramError = heif_encoder_set_parameter(encoder.get(), name, value);
+        if (paramError.code) {
+            qWarning("getEncoder() failed to set %s to %s: %s",
+                     name, value, paramError.message);
+            return false;
+        }
+        return true;
+    };
+
+    // used by libheif when it converts RGB images
+    setParameter("chroma", chromaName(settings.chroma));
+
+    if (!settings.preset.isEmpty()) {
+        setParameter("preset", settings.preset.constData());
+    }
+
+    if (settings.threads > 0) {
+        // x265 takes the size of its thread pool as a native parameter
+        const QByteArray threads = QByteArray::number(settings.threads);
+        setParameter("x265:pools", threads.constData());
+    }
+
+    return encoder;
+}
+
+using EncodingOptionsPtr = std::unique_ptr<heif_encoding_options,
+                                           decltype(&heif_encoding_options_free)>;
+
+/**
+ * An image prepared for encoding, with the options to encode it with.
+ */
+struct EncodeItem
+{
+    EncodeItem() :
+        image(nullptr, heif_image_release),
+        options(nullptr, heif_encoding_options_free)
+#if LIBHEIF_NUMERIC_VERSION >= 0x010a0000
+        , nclx(nullptr, heif_nclx_color_profile_free)
+#endif
+    {
+    }
+
+    ImagePtr image;  // null for grid images
+    EncodingOptionsPtr options;
+#if LIBHEIF_NUMERIC_VERSION >= 0x010a0000
+    NclxProfilePtr nclx;  // referenced by options
+#endif
+
+    // grid images
+    std::vector<ImagePtr> tiles;  // row-major
+    QSize gridSize;
+    QSize tileSize;
+
+    std::vector<ImagePtr> thumbnails;
+};
+
+/**
+ * Encodes thumbnails and assigns them to their master image.
+ */
+bool encodeThumbnails(heif_context* context,
+                      heif_encoder* encoder,
+                      const EncodeItem& item,
+                      const heif_image_handle* master)
+{
+    for (const auto& thumbnail : item.thumbnails) {
+        heif_image_handle* thumbPtr = nullptr;
+        auto error = heif_context_encode_image(context, thumbnail.get(), encoder,
+                                               item.options.get(), &thumbPtr);
+
+        auto thumb = wrapPointer(thumbPtr, heif_image_handle_release);
+        if (error.code || !thumb) {
+            qWarning("encodeThumbnails() failed to encode thumbnail: %s", error.message);
+            return false;
+        }
+
+        error = heif_context_assign_thumbnail(context, master, thumb.get());
+        if (error.code) {
+            qWarning("encodeThumbnails() failed to assign thumbnail: %s", error.message);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Encodes an item into a context. The first image encoded into a context
+ * becomes its primary image.
+ */
+bool encodeItem(heif_context* context, heif_encoder* encoder, const EncodeItem& item)
+{
+#if LIBHEIF_NUMERIC_VERSION >= 0x01120000
+    if (!item.image) {
+        const int columns = (item.gridSize.width() + item.tileSize.width() - 1)
+            / item.tileSize.width();
+        const int rows = (item.gridSize.height() + item.tileSize.height() - 1)
+            / item.tileSize.height();
+
+        Q_ASSERT(item.tiles.size() == size_t(columns * rows));
+
+        heif_image_handle* gridPtr = nullptr;
+        auto error = heif_context_add_grid_image(context,
+                                                 item.gridSize.width(),
+                                                 item.gridSize.height(),
+                                                 columns, rows,
+                                                 item.options.get(),
+                                                 &gridPtr);
+
+        auto grid = wrapPointer(gridPtr, heif_image_handle_release);
+        if (error.code || !grid) {
+            qWarning("encodeItem() failed to add grid image: %s", error.message);
+            return false;
+        }
+
+        for (int i = 0; i < columns * rows; ++i) {
+            error = heif_context_add_image_tile(context, grid.get(),
+                                                i % columns, i / columns,
+                                                item.tiles[i].get(), encoder);
+            if (error.code) {
+                qWarning("encodeItem() failed to encode tile %d: %s", i, error.message);
+                return false;
+            }
+        }
+
+        heif_item_id primaryId = 0;
+        if (heif_context_get_primary_image_ID(context, &primaryId).code) {
+            heif_context_set_primary_image(context, grid.get());
+        }
+
+        return encodeThumbnails(context, encoder, item, grid.get());
+    }
+#endif
+
+    heif_image_handle* handlePtr = nullptr;
+    auto error = heif_context_encode_image(context, item.image.get(), encoder,
+                                           item.options.get(), &handlePtr);
+
+    auto handle = wrapPointer(handlePtr, heif_image_handle_release);
+    if (error.code || !handle) {
+        qWarning("encodeItem() failed to encode image: %s", error.message);
+        return false;
+    }
+
+    return encodeThumbnails(context, encoder, item, handle.get());
+}
+
+bool operator==(const EncodeSettings& a, const EncodeSettings& b)
+{
+    return a.quality == b.quality
+        && a.chroma == b.chroma
+        && a.preset == b.preset
+        && a.lossless == b.lossless
+        && a.threads == b.threads;
+}
+
+/**
+ * Process-wide pool of configured encoders, so handlers can skip plugin
+ * lookup and configuration. Encoders are checked out by one writer at a
+ * time.
+ */
+class EncoderPool
+{
+public:
+    static EncoderPool& instance()
+    {
+        // never destroyed, since releasing encoders may not be safe once
+        // libheif's own statics are gone
+        static auto* pool = new EncoderPool;
+        return *pool;
+    }
+
+    /**
+     * Takes an encoder with the given settings out of the pool, or gets a
+     * new one. Returns null on failure.
+     */
+    EncoderPtr take(const EncodeSettings& settings)
+    {
+        {
+            QMutexLocker locker(&_mutex);
+
+            auto it = std::find_if(_entries.begin(), _entries.end(),
+                                   [&](const Entry& entry) {
+                                       return entry.settings == settings;
+                                   });
+
+            if (it != _entries.end()) {
+                auto encoder = std::move(it->encoder);
+                _entries.erase(it);
+                return encoder;
+            }
+        }
+
+        return getEncoder(settings);
+    }
+
+    /**
+     * Returns an encoder to the pool. The least recently returned encoder is
+     * released if the pool is full.
+     */
+    void give(const EncodeSettings& settings, EncoderPtr encoder)
+    {
+        Q_ASSERT(encoder);
+
+        // released after unlocking
+        EncoderPtr dropped{nullptr, heif_encoder_release};
+
+        {
+            QMutexLocker locker(&_mutex);
+
+            if (_entries.size() >= kMaxEncoders) {
+                dropped = std::move(_entries.front().encoder);
+                _entries.erase(_entries.begin());
+            }
+
+            _entries.push_back({settings, std::move(encoder)});
+        }
+    }
+
+private:
+    static constexpr size_t kMaxEncoders = 4;
+
+    struct Entry
+    {
+        EncodeSettings settings;
+        EncoderPtr encoder;
+    };
+
+    QMutex _mutex;
+    std::vector<Entry> _entries;  // oldest first
+};
+
+constexpr size_t EncoderPool::kMaxEncoders;
+
+/**
+ * Adds a plane to a heif image, and returns its data and stride.
+ * Returns null on failure.
+ */
+uint8_t* addPlane(heif_image* image, heif_channel channel, int width, int height, int bits,
+                  int* stride)
+{
+    auto error = heif_image_add_plane(image, channel, width, height, bits);
+    if (error.code) {
+        qWarning("addPlane() failed to add image plane: %s", error.message);
+        return nullptr;
+    }
+
+    uint8_t* data = heif_image_get_plane(image, channel, stride);
+    if (!data) {
+        qWarning("addPlane() could not get libheif image plane");
+        return nullptr;
+    }
+
+    if (*stride < width * bits / 8) {
+        qWarning("addPlane() invalid stride: %d", *stride);
+        return nullptr;
+    }
+
+    return data;
+}
+
+/**
+ * Creates an interleaved RGB(A) heif image from a source image, which
+ * must be convertible by QHeifConvert. libheif converts it to YCbCr for
+ * encoding.
+ */
+ImagePtr createRgbImage(const QImage& srcImage, bool opaque)
+{
+    const QSize size = srcImage.size();
+    const auto destChroma = opaque ? heif_chroma_interleaved_RGB
+                                   : heif_chroma_interleaved_RGBA;
+    const int destPixelSize = opaque ? 3 : 4;
+
+    heif_image* destImagePtr = nullptr;
+    auto error = heif_image_create(size.width(), size.height(),
+                                   heif_colorspace_RGB, destChroma,
+                                   &destImagePtr);
 
-    auto handle = wrapPointer(handlePtr, heif_image_handle_release);
-    if (error.code || !handle) {
-        qWarning("QHeifHandler::write() failed to encode image: %s", error.message);
+    auto destImage = wrapPointer(destImagePtr, heif_image_release);
+    if (error.code || !destImage) {
+        qWarning("createRgbImage() image creation failed: %s", error.message);
+        return {nullptr, heif_image_release};
+    }
+
+    // add rgb(a) plane
+    int destStride = 0;
+    uint8_t* destData = addPlane(destImage.get(), heif_channel_interleaved,
+                                 size.width(), size.height(), 8 * destPixelSize,
+                                 &destStride);
+
+    if (!destData) {
+        return {nullptr, heif_image_release};
+    }
+
+    // convert to rgb(a) data
+    const auto srcFormat = srcImage.format();
+    const auto convertRow = opaque ? QHeifConvert::convertRowToRgb
+                                   : QHeifConvert::convertRowToRgba;
+
+    for (int y = 0; y < size.height(); ++y) {
+        convertRow(srcFormat,
+                   srcImage.constScanLine(y),
+                   destData + y * destStride,
+                   size.width());
+    }
+
+    return destImage;
+}
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x010a0000
+/**
+ * Creates a planar YCbCr heif image with the given chroma from a source
+ * image, which must be convertible to RGBA by QHeifConvert. Pixels are
+ * converted straight into the planes, so libheif doesn't need to convert.
+ *
+ * The image is tagged as full range BT.601, which is what libheif uses for
+ * RGB input by default. Rows are converted on up to the given number of
+ * threads, or on all cores if 0.
+ */
+ImagePtr createYCbCrImage(const QImage& srcImage, bool opaque, heif_chroma chroma,
+                          int threads)
+{
+    const QSize size = srcImage.size();
+    const int shiftX = chroma == heif_chroma_444 ? 0 : 1;
+    const int shiftY = chroma == heif_chroma_420 ? 1 : 0;
+    const QSize chromaSize((size.width() + shiftX) >> shiftX,
+                           (size.height() + shiftY) >> shiftY);
+
+    heif_image* destImagePtr = nullptr;
+    auto error = heif_image_create(size.width(), size.height(),
+                                   heif_colorspace_YCbCr, chroma,
+                                   &destImagePtr);
+
+    auto destImage = wrapPointer(destImagePtr, heif_image_release);
+    if (error.code || !destImage) {
+        qWarning("createYCbCrImage() image creation failed: %s", error.message);
+        return {nullptr, heif_image_release};
+    }
+
+    // tag matrix
+    auto nclx = wrapPointer(heif_nclx_color_profile_alloc(), heif_nclx_color_profile_free);
+    if (!nclx) {
+        qWarning("createYCbCrImage() failed to alloc color profile");
+        return {nullptr, heif_image_release};
+    }
+
+    nclx->color_primaries = heif_color_primaries_ITU_R_BT_709_5;
+    nclx->transfer_characteristics = heif_transfer_characteristic_IEC_61966_2_1;
+    nclx->matrix_coefficients = heif_matrix_coefficients_ITU_R_BT_601_6;
+    nclx->full_range_flag = 1;
+
+    error = heif_image_set_nclx_color_profile(destImage.get(), nclx.get());
+    if (error.code) {
+        qWarning("createYCbCrImage() failed to set color profile: %s", error.message);
+        return {nullptr, heif_image_release};
+    }
+
+    QHeifConvert::YCbCrMatrix matrix;
+    QHeifConvert::findYCbCrMatrix(nclx->matrix_coefficients, nclx->full_range_flag, &matrix);
+
+    // add planes
+    int strideY = 0;
+    int strideCb = 0;
+    int strideCr = 0;
+    int strideAlpha = 0;
+
+    uint8_t* dataY = addPlane(destImage.get(), heif_channel_Y,
+                              size.width(), size.height(), 8, &strideY);
+    uint8_t* dataCb = addPlane(destImage.get(), heif_channel_Cb,
+                               chromaSize.width(), chromaSize.height(), 8, &strideCb);
+    uint8_t* dataCr = addPlane(destImage.get(), heif_channel_Cr,
+                               chromaSize.width(), chromaSize.height(), 8, &strideCr);
+    uint8_t* dataAlpha = opaque ? nullptr
+                                : addPlane(destImage.get(), heif_channel_Alpha,
+                                           size.width(), size.height(), 8, &strideAlpha);
+
+    if (!dataY || !dataCb || !dataCr || (!opaque && !dataAlpha)) {
+        return {nullptr, heif_image_release};
+    }
+
+    // convert in bands of chroma rows, in parallel
+    const auto srcFormat = srcImage.format();
+    const bool srcIsRgba = srcFormat == QImage::Format_RGBA8888
+        || srcFormat == QImage::Format_RGBX8888;
+
+    const int bandHeight = 32;
+    const int numBands = (chromaSize.height() + bandHeight - 1) / bandHeight;
+    const int maxThreads = threads > 0 ? threads : QThread::idealThreadCount();
+
+    parallelFor(numBands, maxThreads, [&](int band) {
+        // rgba rows, if the source needs converting
+        std::vector<uchar> buffer(srcIsRgba ? 0 : 8 * size_t(size.width()));
+
+        auto rgbaRow = [&](int y, int bufferIndex) -> const uchar* {
+            if (srcIsRgba) {
+                return srcImage.constScanLine(y);
+            }
+
+            uchar* row = buffer.data() + bufferIndex * 4 * size.width();
+            QHeifConvert::convertRowToRgba(srcFormat, srcImage.constScanLine(y),
+                                           row, size.width());
+            return row;
+        };
+
+        const int endChromaY = qMin(chromaSize.height(), (band + 1) * bandHeight);
+
+        for (int chromaY = band * bandHeight; chromaY < endChromaY; ++chromaY) {
+            const int y0 = chromaY << shiftY;
+            // the last row of an odd height image is its own pair
+            const int y1 = qMin(y0 + 1, size.height() - 1);
+
+            const uchar* row0 = rgbaRow(y0, 0);
+            const uchar* row1 = shiftY ? (y1 == y0 ? row0 : rgbaRow(y1, 1)) : nullptr;
+
+            QHeifConvert::convertRowsToCbCr(matrix, row0, row1, shiftX,
+                                            dataCb + chromaY * strideCb,
+                                            dataCr + chromaY * strideCr,
+                                            size.width());
+
+            for (int i = 0; i <= shiftY && y0 + i < size.height(); ++i) {
+                const uchar* row = i ? row1 : row0;
+                QHeifConvert::convertRowToY(matrix, row, dataY + (y0 + i) * strideY,
+                                            size.width());
+
+                if (dataAlpha) {
+                    QHeifConvert::convertRowToAlpha(row, dataAlpha + (y0 + i) * strideAlpha,
+                                                    size.width());
+                }
+            }
+        }
+    });
+
+    return destImage;
+}
+#endif
+
+/**
+ * Creates a heif image for encoding with the given settings.
+ */
+ImagePtr createImage(const QImage& srcImage, bool opaque, const EncodeSettings& settings)
+{
+#if LIBHEIF_NUMERIC_VERSION >= 0x010a0000
+    // lossless images stay RGB
+    if (!settings.lossless) {
+        return createYCbCrImage(srcImage, opaque, settings.chroma, settings.threads);
+    }
+#else
+    Q_UNUSED(settings);
+#endif
+
+    return createRgbImage(srcImage, opaque);
+}
+
+/**
+ * Returns the tile size to encode an image of the given size with, or an
+ * empty size if it should not be tiled. Images too large for a single HEVC
+ * picture are always tiled.
+ */
+QSize gridTileSize(const QSize& size, int tileSize)
+{
+#if LIBHEIF_NUMERIC_VERSION >= 0x01120000
+    // HEVC level 6.2 limits
+    constexpr int kMaxPictureSide = 16888;
+    constexpr qint64 kMaxPictureArea = 35651584;
+    constexpr int kDefaultTileSize = 512;
+
+    const bool tooLarge = size.width() > kMaxPictureSide
+        || size.height() > kMaxPictureSide
+        || qint64(size.width()) * size.height() > kMaxPictureArea;
+
+    if (tileSize <= 0 && tooLarge) {
+        tileSize = kDefaultTileSize;
+    }
+
+    if (tileSize <= 0 || (tileSize >= size.width() && tileSize >= size.height())) {
+        return {};
+    }
+
+    return {tileSize, tileSize};
+#else
+    Q_UNUSED(size);
+    Q_UNUSED(tileSize);
+    return {};
+#endif
+}
+
+/**
+ * Copies a rect of an image into an image of the given size, which must be
+ * at least as large. Pixels beyond the rect repeat its last column and row,
+ * which compresses better than a flat fill.
+ */
+QImage padImage(const QImage& srcImage, const QRect& rect, const QSize& size)
+{
+    QImage destImage(size, srcImage.format());
+    if (destImage.isNull()) {
+        qWarning("padImage() failed to allocate image");
+        return {};
+    }
+
+    const int pixelSize = srcImage.depth() / 8;
+    const int lineSize = rect.width() * pixelSize;
+
+    for (int y = 0; y < size.height(); ++y) {
+        const int srcY = rect.top() + qMin(y, rect.height() - 1);
+        const uchar* src = srcImage.constScanLine(srcY) + rect.left() * pixelSize;
+        uchar* dest = destImage.scanLine(y);
+
+        std::copy(src, src + lineSize, dest);
+
+        const uchar* lastPixel = src + lineSize - pixelSize;
+        for (int x = rect.width(); x < size.width(); ++x) {
+            std::copy(lastPixel, lastPixel + pixelSize, dest + x * pixelSize);
+        }
+    }
+
+    return destImage;
+}
+
+/**
+ * Creates the tiles of a grid image, in parallel on up to settings.threads
+ * threads, or on all cores if 0. Returns an empty list on failure.
+ */
+std::vector<ImagePtr> createTiles(const QImage& srcImage,
+                                  bool opaque,
+                                  const EncodeSettings& settings,
+                                  const QSize& tileSize)
+{
+    const int columns = (srcImage.width() + tileSize.width() - 1) / tileSize.width();
+    const int rows = (srcImage.height() + tileSize.height() - 1) / tileSize.height();
+
+    std::vector<ImagePtr> tiles;
+    tiles.reserve(columns * rows);
+
+    for (int i = 0; i < columns * rows; ++i) {
+        tiles.emplace_back(nullptr, heif_image_release);
+    }
+
+    std::atomic<bool> failed{false};
+    const int maxThreads = settings.threads > 0 ? settings.threads
+                                                : QThread::idealThreadCount();
+
+    parallelFor(columns * rows, maxThreads, [&](int i) {
+        if (failed) {
+            return;
+        }
+
+        const QRect tileRect(QPoint((i % columns) * tileSize.width(),
+                                    (i / columns) * tileSize.height()),
+                             tileSize);
+        const QRect srcRect = tileRect.intersected(srcImage.rect());
+
+        // inner tiles refer to the source data; edge tiles are padded to the
+        // full tile size
+        const QImage tileImage = srcRect == tileRect
+            ? QImage(srcImage.constScanLine(tileRect.top())
+                         + tileRect.left() * (srcImage.depth() / 8),
+                     tileRect.width(), tileRect.height(),
+                     srcImage.bytesPerLine(), srcImage.format())
+            : padImage(srcImage, srcRect, tileSize);
+
+        if (!tileImage.isNull()) {
+            tiles[i] = createImage(tileImage, opaque, settings);
+        }
+
+        if (!tiles[i]) {
+            failed = true;
+        }
+    });
+
+    if (failed) {
+        return {};
+    }
+
+    return tiles;
+}
+
+/**
+ * Creates thumbnails that fit in boxes of the given sizes. Sizes that the
+ * image already fits in are skipped. Returns false on failure.
+ */
+bool createThumbnails(const QImage& srcImage,
+                      bool opaque,
+                      const EncodeSettings& settings,
+                      const std::vector<int>& sizes,
+                      std::vector<ImagePtr>* thumbnails)
+{
+    for (int size : sizes) {
+        if (srcImage.width() <= size && srcImage.height() <= size) {
+            continue;
+        }
+
+        QImage thumbImage = srcImage.scaled(size, size,
+                                            Qt::KeepAspectRatio,
+                                            Qt::SmoothTransformation);
+
+        // smooth scaling may change the format
+        if (!thumbImage.isNull() && !QHeifConvert::canConvertToRgba(thumbImage.format())) {
+            thumbImage = thumbImage.convertToFormat(QImage::Format_RGBA8888);
+        }
+
+        if (thumbImage.isNull()) {
+            qWarning("createThumbnails() failed to scale image");
+            return false;
+        }
+
+        auto thumbnail = createImage(thumbImage, opaque, settings);
+        if (!thumbnail) {
+            return false;
+        }
+
+        thumbnails->push_back(std::move(thumbnail));
+    }
+
+    return true;
+}
+
+}  // namespace
+
+/**
+ * Encoder checked out of the pool by a handler. Returned to the pool when
+ * the handler is done with it.
+ */
+struct QHeifHandler::EncoderLease
+{
+    explicit EncoderLease(const EncodeSettings& s) :
+        settings(s),
+        encoder(EncoderPool::instance().take(s))
+    {
+    }
+
+    ~EncoderLease()
+    {
+        if (encoder) {
+            EncoderPool::instance().give(settings, std::move(encoder));
+        }
+    }
+
+    EncodeSettings settings;
+    EncoderPtr encoder;
+};
+
+/**
+ * Encodes an image of a multi-image file, possibly in the background.
+ */
+struct QHeifHandler::EncodeJob : BackgroundJob
+{
+    EncodeJob(heif_context* ctx, heif_encoder* enc, EncodeItem&& encodeItem) :
+        context(ctx),
+        encoder(enc),
+        item(std::move(encodeItem)),
+        ok(false)
+    {
+    }
+
+    void run() override
+    {
+        ok = encodeItem(context, encoder, item);
+        item = EncodeItem();
+    }
+
+    /**
+     * Runs job if needed, and waits until it is done. Returns whether
+     * encoding succeeded.
+     */
+    bool finish()
+    {
+        tryRun();
+        wait();
+        return ok;
+    }
+
+    heif_context* const context;
+    heif_encoder* const encoder;
+    EncodeItem item;
+
+    bool ok;  // valid once state is Done
+};
+
+QHeifHandler::WriteState::WriteState(int count) :
+    context(heif_context_alloc(), heif_context_free),
+    imageCount(count),
+    numImages(0),
+    encodeJob()
+{
+}
+
+QHeifHandler::WriteState::~WriteState()
+{
+    // job uses the context
+    if (encodeJob) {
+        encodeJob->finish();
+    }
+
+    if (numImages < imageCount) {
+        qWarning("QHeifHandler::WriteState::~WriteState() file not written;"
+                 " only %d of %d images were added", numImages, imageCount);
+    }
+}
+
+bool QHeifHandler::WriteState::finishEncoding()
+{
+    if (!encodeJob) {
+        return true;
+    }
+
+    const bool ok = encodeJob->finish();
+    encodeJob.reset();
+    return ok;
+}
+
+bool QHeifHandler::write(const QImage& preConvSrcImage)
+{
+    updateDevice();
+
+    if (!device()) {
+        qWarning("QHeifHandler::write() device null before write");
+        return false;
+    }
+
+    if (preConvSrcImage.isNull()) {
+        qWarning("QHeifHandler::write() source image is null");
+        return false;
+    }
+
+    // opaque images are written without alpha, which would just waste space
+    QImage srcImage = preConvSrcImage;
+    const bool opaque = QHeifConvert::isOpaque(srcImage);
+
+    // most formats are converted while copying into the heif image;
+    // convert the others up front
+    if (opaque && !QHeifConvert::canConvertToRgb(srcImage.format())) {
+        srcImage = srcImage.convertToFormat(QImage::Format_RGB888);
+    } else if (!opaque && !QHeifConvert::canConvertToRgba(srcImage.format())) {
+        srcImage = srcImage.convertToFormat(QImage::Format_RGBA8888);
+    }
+
+    if (srcImage.isNull()) {
+        qWarning("QHeifHandler::write() source image format conversion failed");
+        return false;
+    }
+
+    EncodeSettings settings;
+    settings.quality = _quality;
+    settings.chroma = _lossless ? heif_chroma_444 : _chroma;
+    settings.preset = _preset;
+    settings.lossless = _lossless;
+    settings.threads = _encodeThreads;
+
+    auto options = wrapPointer(heif_encoding_options_alloc(), heif_encoding_options_free);
+    if (!options) {
+        qWarning("QHeifHandler::write() failed to alloc encoding options");
+        return false;
+    }
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x010a0000
+    auto nclx = wrapPointer(heif_nclx_color_profile_alloc(), heif_nclx_color_profile_free);
+    if (!nclx) {
+        qWarning("QHeifHandler::write() failed to alloc color profile");
+        return false;
+    }
+
+    // lossless images stay RGB, and are encoded without a YCbCr matrix
+    if (settings.lossless) {
+        nclx->matrix_coefficients = heif_matrix_coefficients_RGB_GBR;
+        nclx->full_range_flag = 1;
+        options->output_nclx_profile = nclx.get();
+    }
+#endif
+
+    EncodeItem item;
+    item.options = std::move(options);
+#if LIBHEIF_NUMERIC_VERSION >= 0x010a0000
+    item.nclx = std::move(nclx);
+#endif
+
+    const QSize tileSize = gridTileSize(srcImage.size(), _tileSize);
+
+    if (tileSize.isEmpty()) {
+        item.image = createImage(srcImage, opaque, settings);
+
+        if (!item.image) {
+            return false;
+        }
+    } else {
+        item.tiles = createTiles(srcImage, opaque, settings, tileSize);
+        item.gridSize = srcImage.size();
+        item.tileSize = tileSize;
+
+        if (item.tiles.empty()) {
+            qWarning("QHeifHandler::write() failed to create tiles");
+            return false;
+        }
+    }
+
+    if (!createThumbnails(srcImage, opaque, settings, _thumbnailSizes, &item.thumbnails)) {
+        qWarning("QHeifHandler::write() failed to create thumbnails");
+        return false;
+    }
+
+    // don't reuse an encoder in an unknown state
+    auto dropEncoder = [this]() {
+        if (_encoder) {
+            _encoder->encoder.reset();
+            _encoder.reset();
+        }
+    };
+
+    // the previous image of a multi-image file may still use the encoder
+    if (_writeState && !_writeState->finishEncoding()) {
+        qWarning("QHeifHandler::write() failed to encode previous image");
+        _writeState->imageCount = _writeState->numImages;
+        _writeState.reset();
+        dropEncoder();
+        return false;
+    }
+
+    // keep the encoder for following writes with the same settings
+    if (!_encoder || !(_encoder->settings == settings)) {
+        _encoder.reset();
+        _encoder.reset(new EncoderLease(settings));
+    }
+
+    heif_encoder* encoder = _encoder->encoder.get();
+    if (!encoder) {
+        _encoder.reset();
+        return false;
+    }
+
+    if (!_writeState) {
+        _writeState.reset(new WriteState(qMax(1, _imageCount)));
+
+        if (!_writeState->context) {
+            qWarning("QHeifHandler::write() failed to alloc context");
+            _writeState->imageCount = 0;
+            _writeState.reset();
+            return false;
+        }
+    }
+
+    WriteState& state = *_writeState;
+    ++state.numImages;
+
+    state.encodeJob = std::make_shared<EncodeJob>(state.context.get(), encoder,
+                                                  std::move(item));
+
+    if (state.numImages < state.imageCount) {
+        // more images follow; the file is written after the last one
+        if (_backgroundEncode) {
+            auto job = state.encodeJob;
+            QThreadPool::globalInstance()->start(new FunctionRunnable([job]() {
+                job->tryRun();
+            }));
+        }
+
+        return true;
+    }
+
+    const bool encoded = state.finishEncoding();
+    auto context = std::move(state.context);
+    _writeState.reset();
+
+    if (!encoded) {
+        dropEncoder();
         return false;
     }
 
-    // write image
+    // write file
     heif_writer writer{1, handleWrite};
-    error = heif_context_write(context.get(), &writer, device());
+    auto error = heif_context_write(context.get(), &writer, device());
     if (error.code) {
         qWarning("QHeifHandler::write() failed to write image: %s", error.message);
         return false;
@@ -525,8 +3788,112 @@ bool QHeifHandler::write(const QImage& preConvSrcImage)
 
 QVariant QHeifHandler::option(ImageOption opt) const
 {
-    Q_UNUSED(opt);
-    return {};
+    switch (opt) {
+    case Size:
+    case ImageFormat: {
+        // answered from container metadata, without decoding
+        if (!ensureContext()) {
+            return {};
+        }
+
+        if (_readState->sequence) {
+            // taken from the track when opened; frames may be decoding
+            const auto& sequence = *_readState->sequence;
+
+            if (opt == ImageFormat) {
+                return frameFormat(sequence.hasAlpha, _premultiplied);
+            }
+
+            return sequence.size.isValid() ? QVariant(sequence.size) : QVariant();
+        }
+
+        auto id = _readState->idList[_readState->currentIndex];
+        auto handle = getImageHandle(_readState->context.get(), id);
+        if (!handle) {
+            return {};
+        }
+
+        DecodeSettings settings{};
+        settings.premultiplied = _premultiplied;
+        settings.hdrTo8Bit = _hdrTo8Bit;
+
+        if (opt == Size) {
+            // size of the image read, before Qt applies its transformation
+            settings.ignoreTransformations = findTransformation(_readState->context.get(),
+                                                                id, nullptr);
+            return decodedSize(handle.get(), settings);
+        } else {
+            return readFormat(handle.get(), settings);
+        }
+    }
+
+#if LIBHEIF_NUMERIC_VERSION >= 0x01120000 && QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    case ImageTransformation: {
+        if (_readReleased && _device == device()) {
+            return _releasedTransformation;
+        }
+
+        if (!ensureContext()) {
+            return {};
+        }
+
+        // transformations that can't be left to Qt are applied when decoding
+        int transformation = TransformationNone;
+        if (_readState->sequence) {
+            return transformation;
+        }
+
+        findTransformation(_readState->context.get(),
+                           _readState->idList[_readState->currentIndex],
+                           &transformation);
+        return transformation;
+    }
+
+    case TransformedByDefault:
+        return true;
+#endif
+
+    case Animation:
+        // determined when loading, while the device is still at the file start
+        if (_readReleased && _device == device()) {
+            return _animation;
+        }
+
+        return ensureContext() && _animation;
+
+    case ClipRect:
+        return _clipRect;
+
+    case ScaledSize:
+        return _scaledSize;
+
+    case Description: {
+        // read as text keys (QImageReader::text())
+        heif_compression_format compression = _releasedCompression;
+
+        if (!(_readReleased && _device == device())) {
+            if (!ensureContext()) {
+                return {};
+            }
+
+            compression = currentCompression();
+        }
+
+        DecodeSettings settings{};
+        settings.decoderId = selectedDecoderId();
+
+        const QByteArray decoderId = usedDecoderId(settings, compression);
+        if (decoderId.isEmpty()) {
+            return {};
+        }
+
+        return QStringLiteral("%1: %2").arg(QLatin1String(kDecoderKey),
+                                            QString::fromLatin1(decoderId));
+    }
+
+    default:
+        return {};
+    }
 }
 
 void QHeifHandler::setOption(ImageOption opt, const QVariant& value)
@@ -543,12 +3910,117 @@ void QHeifHandler::setOption(ImageOption opt, const QVariant& value)
         return;
     }
 
+    case ClipRect:
+        _clipRect = value.toRect();
+        return;
+
+    case ScaledSize:
+        _scaledSize = value.toSize();
+        return;
+
+    case Description:
+        setWriteOptions(value.toString());
+        return;
+
     default:
         return;
     }
 }
 
+void QHeifHandler::setWriteOptions(const QString& description)
+{
+    // QImageWriter joins "key: value" pairs with blank lines
+    for (const QString& pair : description.split(QStringLiteral("\n\n"))) {
+        const int colon = pair.indexOf(QLatin1Char(':'));
+        if (colon < 0) {
+            continue;
+        }
+
+        const QString key = pair.left(colon).trimmed().toLower();
+        const QString value = pair.mid(colon + 1).trimmed();
+
+        if (key == QLatin1String(kChromaKey)) {
+            if (value == QLatin1String("420")) {
+                _chroma = heif_chroma_420;
+            } else if (value == QLatin1String("422")) {
+                _chroma = heif_chroma_422;
+            } else if (value == QLatin1String("444")) {
+                _chroma = heif_chroma_444;
+            } else {
+                qWarning("QHeifHandler::setWriteOptions() invalid %s: %s",
+                         kChromaKey, qUtf8Printable(value));
+            }
+        } else if (key == QLatin1String(kPresetKey)) {
+            _preset = value.toLatin1();
+        } else if (key == QLatin1String(kLosslessKey)) {
+            _lossless = value == QLatin1String("1") || value == QLatin1String("true");
+        } else if (key == QLatin1String(kImageCountKey)) {
+            bool ok = false;
+            const int count = value.toInt(&ok);
+
+            if (ok && count >= 1) {
+                _imageCount = count;
+            } else {
+                qWarning("QHeifHandler::setWriteOptions() invalid %s: %s",
+                         kImageCountKey, qUtf8Printable(value));
+            }
+        } else if (key == QLatin1String(kTileSizeKey)) {
+            bool ok = false;
+            const int size = value.toInt(&ok);
+
+            // even sizes keep subsampled chroma aligned to tiles
+            if (ok && size >= 0 && size % 2 == 0) {
+                _tileSize = size;
+            } else {
+                qWarning("QHeifHandler::setWriteOptions() invalid %s: %s",
+                         kTileSizeKey, qUtf8Printable(value));
+            }
+        } else if (key == QLatin1String(kThumbnailSizesKey)) {
+            std::vector<int> sizes;
+
+            for (const QString& part : value.split(QLatin1Char(','))) {
+                bool ok = false;
+                const int size = part.trimmed().toInt(&ok);
+
+                if (!ok || size <= 0) {
+                    qWarning("QHeifHandler::setWriteOptions() invalid %s: %s",
+                             kThumbnailSizesKey, qUtf8Printable(value));
+                    sizes.clear();
+                    break;
+                }
+
+                sizes.push_back(size);
+            }
+
+            _thumbnailSizes = sizes;
+        } else if (key == QLatin1String(kBackgroundEncodeKey)) {
+            _backgroundEncode = value == QLatin1String("1") || value == QLatin1String("true");
+        } else if (key == QLatin1String(kEncodeThreadsKey)) {
+            bool ok = false;
+            const int threads = value.toInt(&ok);
+
+            if (ok && threads >= 0) {
+                _encodeThreads = threads;
+            } else {
+                qWarning("QHeifHandler::setWriteOptions() invalid %s: %s",
+                         kEncodeThreadsKey, qUtf8Printable(value));
+            }
+        }
+    }
+}
+
 bool QHeifHandler::supportsOption(ImageOption opt) const
 {
-    return opt == Quality;
+    return opt == Quality
+        || opt == Size
+        || opt == ImageFormat
+        || opt == Animation
+        || opt == ClipRect
+        || opt == ScaledSize
+        || opt == Description
+#if LIBHEIF_NUMERIC_VERSION >= 0x01120000 && QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+        || opt == ImageTransformation
+        || opt == TransformedByDefault
+#endif
+        ;
 }
@@ -23,7 +23,11 @@
 
 #include <libheif/heif.h>
 
+#include <QtCore/QByteArray>
+#include <QtCore/QFile>
 #include <QtCore/QIODevice>
+#include <QtCore/QRect>
+#include <QtCore/QSize>
 #include <QtGui/QImageIOHandler>
 
 #include <memory>
@@ -54,6 +58,8 @@ public:
 
     int currentImageNumber() const override;
     int imageCount() const override;
+    int nextImageDelay() const override;
+    int loopCount() const override;
     bool jumpToImage(int index) override;
     bool jumpToNextImage() override;
 
@@ -64,17 +70,60 @@ public:
     static Format canReadFrom(QIODevice& device);
 
 private:
+    struct DeviceReader;
+    struct DecodeJob;
+    struct SequenceState;
+    struct FrameJob;
+    struct EncoderLease;
+    struct EncodeJob;
+
     struct ReadState
     {
         ReadState(QByteArray&& data,
+                  std::unique_ptr<QFile>&& file,
+                  std::unique_ptr<DeviceReader>&& reader,
                   std::shared_ptr<heif_context>&& ctx,
                   std::vector<heif_item_id>&& ids,
                   int index);
+        ~ReadState();
 
+        // context data source; exactly one of these is used
         const QByteArray fileData;
+        const std::unique_ptr<QFile> mappedFile;  // owns memory mapping
+        const std::unique_ptr<DeviceReader> deviceReader;
+
         const std::shared_ptr<heif_context> context;
         const std::vector<heif_item_id> idList;
         int currentIndex{};
+        bool imageRead{};  // image at currentIndex has been read
+        int numReadInOrder{};  // leading images of idList read so far
+        Format fileFormat{Format::None};  // from the brand
+
+        std::vector<std::shared_ptr<DecodeJob>> decodeJobs;  // decoding ahead
+
+        // frames read instead of idList images; null if not a sequence
+        std::unique_ptr<SequenceState> sequence;
+    };
+
+    /**
+     * Multi-image file being written. The file is written to the device
+     * once all images are added.
+     */
+    struct WriteState
+    {
+        explicit WriteState(int count);
+        ~WriteState();
+
+        /**
+         * Waits for the last added image to be encoded. Returns false if
+         * encoding failed.
+         */
+        bool finishEncoding();
+
+        std::unique_ptr<heif_context, void (*)(heif_context*)> context;
+        int imageCount;  // images in the file
+        int numImages;   // images added so far
+        std::shared_ptr<EncodeJob> encodeJob;  // encodes last added image
     };
 
     /**
@@ -84,9 +133,70 @@ private:
 
     /**
      * Reads data from device. Creates read state.
+     *
+     * Files are memory-mapped, and other random-access devices are read
+     * lazily, so only the parts of the file that are actually used get read.
+     * Sequential devices are read fully.
      */
     void loadContext();
 
+    /**
+     * Opens the first track of a context with image sequences. Returns null
+     * if there are no sequences, or libheif can't read them.
+     */
+    std::unique_ptr<SequenceState> openSequence(heif_context* context) const;
+
+    /**
+     * Reads a new context from the device, mapping or reading the file
+     * into the given data as needed. Returns null on failure.
+     */
+    std::shared_ptr<heif_context> readContextFromDevice(
+        QByteArray* fileData,
+        std::unique_ptr<QFile>* mappedFile,
+        std::unique_ptr<DeviceReader>* deviceReader);
+
+    /**
+     * Loads context, if needed, for const queries. Does not decode pixels.
+     * Returns false if no context is available.
+     */
+    bool ensureContext() const;
+
+    /**
+     * Starts decoding images from firstIndex in the background, as many as
+     * the decode-ahead depth allows. Cancels jobs no longer needed.
+     */
+    void updateDecodeAhead(int firstIndex, bool premultiplied);
+
+    /**
+     * Gets the next frame of a sequence, decoding it if it was not decoded
+     * ahead, and starts decoding following frames in the background, as
+     * many as the decode-ahead depth allows. Returns false if no frames are
+     * left.
+     */
+    bool fetchFrame();
+
+    /**
+     * Reads the next frame of a sequence.
+     */
+    bool readFrame(QImage* image);
+
+    /**
+     * Returns the compression format of the current image, or of the frames
+     * of a sequence, for reporting its decoder. Read state must be loaded.
+     */
+    heif_compression_format currentCompression() const;
+
+    /**
+     * Drops read state once all images have been read in order, keeping
+     * only what is needed to answer image count and number queries.
+     */
+    void releaseReadState();
+
+    /**
+     * Applies write options given as text keys (QImageWriter::setText()).
+     */
+    void setWriteOptions(const QString& description);
+
     //
     // Private data
     //
@@ -96,6 +206,35 @@ private:
     std::unique_ptr<ReadState> _readState;  // non-null iff context is loaded
 
     int _quality;
+    heif_chroma _chroma;  // chroma subsampling of written images
+    QByteArray _preset;   // encoder preset; empty for default
+    bool _lossless;
+    int _encodeThreads;   // 0 if automatic
+
+    int _imageCount;        // images per written file
+    bool _backgroundEncode;  // return from write() before encoding ends
+    int _tileSize;  // grid tile size of written images; 0 if untiled
+    std::vector<int> _thumbnailSizes;  // bounding boxes of written thumbnails
+
+    std::unique_ptr<EncoderLease> _encoder;  // kept for following writes
+    std::unique_ptr<WriteState> _writeState;  // non-null while adding images
+    QRect _clipRect;
+    QSize _scaledSize;
+
+    int _decodeThreads;  // 0 if automatic
+    int _decodeAhead;    // number of images to decode ahead; 0 if disabled
+    bool _premultiplied;  // read paint-ready formats
+    bool _hdrTo8Bit;      // read 8-bit formats only
+    bool _lowMemory;      // drop read state after reading all images
+    bool _animation;      // of the loaded file; kept while read state is released
+
+    // set while read state is released; reset on device change
+    bool _readReleased;
+    int _releasedImageCount;
+    int _releasedImageIndex;
+    int _releasedTransformation;  // of the last image
+    int _releasedFrameDelay;      // of the last frame
+    heif_compression_format _releasedCompression;  // of the last image
 };
 
 #endif  // QHEIFHANDLER_P_H